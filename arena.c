@@ -0,0 +1,160 @@
+#include "arena.h"
+
+#include "stats.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace parser {
+    CaffArena::CaffArena(size_t capacity) {
+        reserve(capacity);
+    }
+
+    CaffArena::~CaffArena() {
+        std::free(block);
+    }
+
+    void CaffArena::reserve(size_t size) {
+        if (blockUsed != 0 || size <= blockSize) {
+            return;
+        }
+
+        std::free(block);
+        block = static_cast<char *>(std::malloc(size));
+        blockSize = block != nullptr ? size : 0;
+    }
+
+    void CaffArena::release() {
+        blockUsed = 0;
+        overflow.release();
+    }
+
+    void *CaffArena::do_allocate(size_t bytes, size_t alignment) {
+        if (block != nullptr) {
+            size_t start = (blockUsed + alignment - 1) & ~(alignment - 1);
+
+            if (start >= blockUsed && start <= blockSize && bytes <= blockSize - start) {
+                blockUsed = start + bytes;
+                return block + start;
+            }
+        }
+
+        return overflow.allocate(bytes, alignment);
+    }
+
+    namespace pmr {
+        CIFF::CIFF(const CIFF &other, const allocator_type &allocator)
+                : header_size(other.header_size), content_size(other.content_size), width(other.width),
+                  height(other.height), pixels(other.pixels, allocator) {
+            std::memcpy(magic, other.magic, sizeof(magic));
+        }
+
+        CIFF::CIFF(CIFF &&other, const allocator_type &allocator)
+                : header_size(other.header_size), content_size(other.content_size), width(other.width),
+                  height(other.height), pixels(std::move(other.pixels), allocator) {
+            std::memcpy(magic, other.magic, sizeof(magic));
+        }
+    }
+
+    // Upper bound of the padding a single allocation may need in the arena.
+    static const size_t allocationSlack = alignof(std::max_align_t);
+
+    static void copyCiff(const CIFF_VIEW &view, pmr::CIFF &ciff) {
+        std::memcpy(ciff.magic, view.magic, sizeof(ciff.magic));
+        ciff.header_size = view.header_size;
+        ciff.content_size = view.content_size;
+        ciff.width = view.width;
+        ciff.height = view.height;
+        STATS_TIMER(PIXEL_COPY);
+        ciff.pixels.assign(view.pixels, view.pixels + view.content_size);
+    }
+
+    template<typename T>
+    static T *constructInArena(CaffArena &arena) {
+        return new(arena.allocate(sizeof(T), alignof(T))) T(pmr::allocator_type(&arena));
+    }
+
+    bool parseCiff(ByteSpan buffer, CaffArena &arena, pmr::CIFF *&ciff) {
+        arena.release();
+
+        uint64_t pos = 0;
+        CIFF_VIEW view;
+
+        if (!parseCiff(buffer, pos, view)) {
+            return false;
+        }
+
+        arena.reserve((size_t) view.content_size + sizeof(pmr::CIFF) + 2 * allocationSlack);
+
+        ciff = constructInArena<pmr::CIFF>(arena);
+        copyCiff(view, *ciff);
+
+        return true;
+    }
+
+    bool parseCaff(ByteSpan buffer, CaffArena &arena, pmr::CAFF *&caff) {
+        arena.release();
+
+        // Index first so the total size is known and the whole document fits into one block.
+        CAFF_INDEX index;
+
+        if (!indexCaff(buffer, index)) {
+            return false;
+        }
+
+        size_t size = sizeof(pmr::CAFF) + allocationSlack +
+                      index.frames.size() * sizeof(pmr::CAFF_ANIMATION) + allocationSlack +
+                      index.credits.creator.size() + allocationSlack;
+
+        for (const CAFF_FRAME_INDEX &frame : index.frames) {
+            size += (size_t) (frame.width * frame.height * 3) + allocationSlack;
+        }
+
+        arena.reserve(size);
+
+        caff = constructInArena<pmr::CAFF>(arena);
+        caff->header = index.header;
+        caff->credits.year = index.credits.year;
+        caff->credits.month = index.credits.month;
+        caff->credits.day = index.credits.day;
+        caff->credits.hour = index.credits.hour;
+        caff->credits.minute = index.credits.minute;
+        caff->credits.creator.assign(index.credits.creator);
+        caff->animations.reserve(index.frames.size());
+
+        for (const CAFF_FRAME_INDEX &frame : index.frames) {
+            CIFF_VIEW view;
+
+            if (!loadCaffFrame(buffer, frame, view)) {
+                return false;
+            }
+
+            caff->animations.emplace_back();
+            caff->animations.back().duration = frame.duration;
+            copyCiff(view, caff->animations.back().ciff);
+        }
+
+        return true;
+    }
+
+    bool parseCiffFile(std::string filePath, CaffArena &arena, pmr::CIFF *&ciff) {
+        MappedFile file;
+
+        if (!file.open(filePath)) {
+            return setParseError(ErrorCode::OPEN_FAILED, 0);
+        }
+
+        return parseCiff(file.bytes(), arena, ciff);
+    }
+
+    bool parseCaffFile(std::string filePath, CaffArena &arena, pmr::CAFF *&caff) {
+        MappedFile file;
+
+        if (!file.open(filePath)) {
+            return setParseError(ErrorCode::OPEN_FAILED, 0);
+        }
+
+        return parseCaff(file.bytes(), arena, caff);
+    }
+}
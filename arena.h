@@ -0,0 +1,106 @@
+#ifndef PARSER_ARENA_H
+#define PARSER_ARENA_H
+
+#include "parser.h"
+
+#include <memory_resource>
+
+namespace parser {
+    // Bump allocator that a whole parsed document is placed into. Everything allocated from it is dropped at once
+    // by release(), which keeps the main block around so the arena can be reused for the next document.
+    // Requests that do not fit into the main block are served from an overflow resource released together with it.
+    class CaffArena : public std::pmr::memory_resource {
+    public:
+        explicit CaffArena(size_t capacity = 0);
+        ~CaffArena() override;
+
+        CaffArena(const CaffArena &) = delete;
+        CaffArena &operator=(const CaffArena &) = delete;
+
+        // Grows the main block to at least size bytes. Only has an effect while the arena is empty.
+        void reserve(size_t size);
+
+        void release();
+
+        size_t capacity() const { return blockSize; }
+        size_t used() const { return blockUsed; }
+
+    private:
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *, size_t, size_t) override {}
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+        char *block = nullptr;
+        size_t blockSize = 0;
+        size_t blockUsed = 0;
+        std::pmr::monotonic_buffer_resource overflow;
+    };
+
+    // Allocator-aware variants of the CAFF/CIFF structures, whose storage comes from a memory resource.
+    namespace pmr {
+        using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+        struct CIFF {
+            using allocator_type = pmr::allocator_type;
+
+            explicit CIFF(const allocator_type &allocator = {}) : pixels(allocator) {}
+            CIFF(const CIFF &other, const allocator_type &allocator);
+            CIFF(CIFF &&other, const allocator_type &allocator);
+
+            char magic[4];
+            uint64_t header_size;
+            uint64_t content_size;
+            uint64_t width;
+            uint64_t height;
+            std::pmr::vector<char> pixels;
+        };
+
+        struct CAFF_CREDITS {
+            using allocator_type = pmr::allocator_type;
+
+            explicit CAFF_CREDITS(const allocator_type &allocator = {}) : creator(allocator) {}
+
+            uint16_t year;
+            uint8_t month;
+            uint8_t day;
+            uint8_t hour;
+            uint8_t minute;
+            std::pmr::string creator;
+        };
+
+        struct CAFF_ANIMATION {
+            using allocator_type = pmr::allocator_type;
+
+            explicit CAFF_ANIMATION(const allocator_type &allocator = {}) : ciff(allocator) {}
+            CAFF_ANIMATION(const CAFF_ANIMATION &other, const allocator_type &allocator)
+                    : duration(other.duration), ciff(other.ciff, allocator) {}
+            CAFF_ANIMATION(CAFF_ANIMATION &&other, const allocator_type &allocator)
+                    : duration(other.duration), ciff(std::move(other.ciff), allocator) {}
+
+            uint64_t duration;
+            CIFF ciff;
+        };
+
+        struct CAFF {
+            using allocator_type = pmr::allocator_type;
+
+            explicit CAFF(const allocator_type &allocator = {}) : credits(allocator), animations(allocator) {}
+
+            CAFF_HEADER header;
+            CAFF_CREDITS credits;
+            std::pmr::vector<CAFF_ANIMATION> animations;
+        };
+    }
+
+    // Parse a complete document into arena, which is released first. The arena is grown so the document lands in a
+    // single block; the result stays valid until the next release() and needs no destruction.
+    bool parseCiff(ByteSpan buffer, CaffArena &arena, pmr::CIFF *&ciff);
+
+    bool parseCaff(ByteSpan buffer, CaffArena &arena, pmr::CAFF *&caff);
+
+    bool parseCiffFile(std::string filePath, CaffArena &arena, pmr::CIFF *&ciff);
+
+    bool parseCaffFile(std::string filePath, CaffArena &arena, pmr::CAFF *&caff);
+}
+
+#endif //PARSER_ARENA_H
@@ -0,0 +1,200 @@
+#include "avi.h"
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+
+namespace converter {
+    static const uint64_t minimumTick = 10;
+    static const uint64_t defaultTick = 40;
+    // Upper bound on the number of timebase ticks, so a few very long durations cannot make the index explode.
+    static const uint64_t maximumTicks = 1 << 20;
+
+    static const uint32_t avifHasIndex = 0x10;
+    static const uint32_t aviifKeyframe = 0x10;
+
+    static void put16(std::vector<uint8_t> &out, uint16_t value) {
+        out.push_back((uint8_t) (value & 0xFF));
+        out.push_back((uint8_t) (value >> 8));
+    }
+
+    static void put32(std::vector<uint8_t> &out, uint32_t value) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            out.push_back((uint8_t) ((value >> shift) & 0xFF));
+        }
+    }
+
+    static void putFourCC(std::vector<uint8_t> &out, const char *fourCC) {
+        out.insert(out.end(), fourCC, fourCC + 4);
+    }
+
+    static uint64_t paddedSize(uint64_t size) {
+        return size + (size & 1);
+    }
+
+    static uint64_t pickTick(const std::vector<AviFrame> &frames) {
+        uint64_t tick = 0;
+        uint64_t total = 0;
+
+        for (const AviFrame &frame : frames) {
+            tick = std::gcd(tick, frame.duration);
+            total = (total > UINT64_MAX - frame.duration) ? UINT64_MAX : total + frame.duration;
+        }
+
+        if (tick == 0) {
+            return defaultTick;
+        }
+
+        return std::max({tick, minimumTick, total / maximumTicks + 1});
+    }
+
+    bool writeMjpegAvi(const std::string &filePath, uint32_t width, uint32_t height, const std::vector<AviFrame> &frames) {
+        STATS_TIMER(WRITE_OUTPUT);
+        const uint64_t tick = pickTick(frames);
+
+        if (tick > UINT32_MAX) {
+            printf("Frame durations are too long for an AVI file.\n");
+            return false;
+        }
+
+        // pictures[i] is the JPEG frame i shows, or nullptr if it only extends the picture before it.
+        std::vector<const std::vector<uint8_t> *> pictures(frames.size());
+        std::vector<uint64_t> repeats(frames.size());
+        uint64_t totalTicks = 0;
+        uint64_t moviSize = 4;
+        uint64_t largestFrame = 0;
+
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (frames[i].same_as > i || frames[frames[i].same_as].same_as != frames[i].same_as) {
+                printf("Invalid repeated frame reference.\n");
+                return false;
+            }
+
+            if (i == 0 || frames[i].same_as != frames[i - 1].same_as) {
+                pictures[i] = &frames[frames[i].same_as].jpeg;
+            }
+
+            repeats[i] = std::max<uint64_t>((frames[i].duration + tick / 2) / tick, 1);
+            totalTicks += repeats[i];
+            moviSize += 8 * repeats[i];
+
+            if (pictures[i] != nullptr) {
+                moviSize += paddedSize(pictures[i]->size());
+                largestFrame = std::max<uint64_t>(largestFrame, pictures[i]->size());
+            }
+        }
+
+        const uint64_t hdrlSize = 4 + (8 + 56) + (8 + 4 + (8 + 56) + (8 + 40));
+        const uint64_t idx1Size = 16 * totalTicks;
+        const uint64_t riffSize = 4 + (8 + hdrlSize) + (8 + moviSize) + (8 + idx1Size);
+
+        if (riffSize > UINT32_MAX) {
+            printf("Animation is too large for an AVI file.\n");
+            return false;
+        }
+
+        std::vector<uint8_t> header;
+        putFourCC(header, "RIFF"); put32(header, (uint32_t) riffSize); putFourCC(header, "AVI ");
+        putFourCC(header, "LIST"); put32(header, (uint32_t) hdrlSize); putFourCC(header, "hdrl");
+
+        putFourCC(header, "avih"); put32(header, 56);
+        put32(header, (uint32_t) std::min<uint64_t>(tick * 1000, UINT32_MAX));
+        put32(header, (uint32_t) std::min<uint64_t>(largestFrame * 1000 / tick, UINT32_MAX));
+        put32(header, 0);
+        put32(header, avifHasIndex);
+        put32(header, (uint32_t) totalTicks);
+        put32(header, 0);
+        put32(header, 1);
+        put32(header, (uint32_t) paddedSize(largestFrame));
+        put32(header, width);
+        put32(header, height);
+        for (int i = 0; i < 4; i++) {
+            put32(header, 0);
+        }
+
+        putFourCC(header, "LIST"); put32(header, 4 + (8 + 56) + (8 + 40)); putFourCC(header, "strl");
+
+        putFourCC(header, "strh"); put32(header, 56);
+        putFourCC(header, "vids"); putFourCC(header, "MJPG");
+        put32(header, 0);
+        put16(header, 0); put16(header, 0);
+        put32(header, 0);
+        put32(header, (uint32_t) tick);
+        put32(header, 1000);
+        put32(header, 0);
+        put32(header, (uint32_t) totalTicks);
+        put32(header, (uint32_t) paddedSize(largestFrame));
+        put32(header, UINT32_MAX);
+        put32(header, 0);
+        put16(header, 0); put16(header, 0);
+        put16(header, (uint16_t) std::min<uint32_t>(width, INT16_MAX)); put16(header, (uint16_t) std::min<uint32_t>(height, INT16_MAX));
+
+        putFourCC(header, "strf"); put32(header, 40);
+        put32(header, 40);
+        put32(header, width);
+        put32(header, height);
+        put16(header, 1);
+        put16(header, 24);
+        putFourCC(header, "MJPG");
+        put32(header, (uint32_t) std::min<uint64_t>((uint64_t) width * height * 3, UINT32_MAX));
+        for (int i = 0; i < 4; i++) {
+            put32(header, 0);
+        }
+
+        putFourCC(header, "LIST"); put32(header, (uint32_t) moviSize); putFourCC(header, "movi");
+
+        std::vector<uint8_t> index;
+        index.reserve(8 + idx1Size);
+        putFourCC(index, "idx1"); put32(index, (uint32_t) idx1Size);
+
+        FILE *file = fopen(filePath.c_str(), "wb");
+
+        if (file == nullptr) {
+            printf("Failed to create AVI file.\n");
+            return false;
+        }
+
+        bool success = fwrite(header.data(), header.size(), 1, file) == 1;
+        uint64_t offset = 4;
+        const uint8_t padding = 0;
+
+        for (size_t i = 0; i < frames.size() && success; i++) {
+            std::vector<uint8_t> chunkHeader;
+            uint64_t r = 0;
+
+            if (pictures[i] != nullptr) {
+                const std::vector<uint8_t> &jpeg = *pictures[i];
+                putFourCC(chunkHeader, "00dc"); put32(chunkHeader, (uint32_t) jpeg.size());
+
+                success = fwrite(chunkHeader.data(), chunkHeader.size(), 1, file) == 1 &&
+                          (jpeg.empty() || fwrite(jpeg.data(), jpeg.size(), 1, file) == 1) &&
+                          ((jpeg.size() & 1) == 0 || fwrite(&padding, 1, 1, file) == 1);
+
+                putFourCC(index, "00dc"); put32(index, aviifKeyframe); put32(index, (uint32_t) offset); put32(index, (uint32_t) jpeg.size());
+                offset += 8 + paddedSize(jpeg.size());
+                r++;
+            }
+
+            // An empty chunk repeats the previous picture for one more tick.
+            chunkHeader.clear();
+            putFourCC(chunkHeader, "00dc"); put32(chunkHeader, 0);
+
+            for (; r < repeats[i] && success; r++) {
+                success = fwrite(chunkHeader.data(), chunkHeader.size(), 1, file) == 1;
+                putFourCC(index, "00dc"); put32(index, 0); put32(index, (uint32_t) offset); put32(index, 0);
+                offset += 8;
+            }
+        }
+
+        success = success && fwrite(index.data(), index.size(), 1, file) == 1;
+        success = (fclose(file) == 0) && success;
+
+        if (!success) {
+            printf("Failed to write AVI file.\n");
+        }
+
+        return success;
+    }
+}
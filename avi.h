@@ -0,0 +1,24 @@
+#ifndef PARSER_AVI_H
+#define PARSER_AVI_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace converter {
+    // same_as is the index of the frame whose picture is shown, the frame's own index unless it repeats an earlier
+    // one. jpeg is only read from frames that are their own same_as.
+    struct AviFrame {
+        std::vector<uint8_t> jpeg;
+        uint64_t duration;
+        uint64_t same_as;
+    };
+
+    // Writes frames, in display order, as a Motion-JPEG AVI. The timebase is the greatest common divisor of the
+    // durations (milliseconds, at least 10), and longer frames are repeated with empty chunks, which players treat
+    // as "keep showing the previous picture". A frame repeating the picture right before it is written as empty chunks
+    // only, other repeats store the earlier JPEG again. width and height go into the stream headers.
+    bool writeMjpegAvi(const std::string &filePath, uint32_t width, uint32_t height, const std::vector<AviFrame> &frames);
+}
+
+#endif //PARSER_AVI_H
@@ -0,0 +1,443 @@
+// Throughput benchmarks for the parser and the encoder, in the spirit of Google Benchmark: every benchmark body runs
+// for a calibrated number of iterations and reports time per iteration, MB/s and items (frames, blocks) per second.
+//
+// Usage: bench [--filter text] [--min-time seconds]
+//
+// The parseCaffFile benchmarks also check that the pixels of every distinct frame are copied exactly once, and bench
+// exits with an error if they are not.
+
+#include "generator.h"
+#include "jpge.h"
+#include "parser.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    // Allocations of exactly watchedSize bytes. A frame's pixels are a std::vector<char> of exactly content_size bytes,
+    // so every copy of them, be it from the input or from another vector, makes one such allocation.
+    std::atomic<size_t> watchedSize(0);
+    std::atomic<uint64_t> watchedAllocations(0);
+
+    bool failed = false;
+}
+
+void *operator new(size_t size) {
+    if (size != 0 && size == watchedSize.load(std::memory_order_relaxed)) {
+        watchedAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void *memory = std::malloc(size > 0 ? size : 1);
+
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return memory;
+}
+
+// Kept out of line, as GCC otherwise sees free() applied to what operator new returned and warns of a mismatch.
+__attribute__((noinline)) void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+    // What one timed call of a benchmark body did. The body runs iterations times and adds up what it processed.
+    struct Run {
+        uint64_t iterations;
+        uint64_t bytes;
+        uint64_t items;
+    };
+
+    struct Benchmark {
+        std::string name;
+        const char *itemName;
+        // Builds the inputs and returns the body, so inputs are only made for benchmarks that run.
+        std::function<std::function<void(Run &)>()> setup;
+    };
+
+    // Keeps the compiler from dropping a computation whose result is otherwise unused.
+    inline void keep(const void *value) {
+        asm volatile("" : : "g"(value) : "memory");
+    }
+
+    struct ImageSize {
+        const char *name;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    const ImageSize tiny = {"tiny", 16, 16};
+    const ImageSize size4k = {"4K", 3840, 2160};
+    const ImageSize size16k = {"16K", 15360, 8640};
+
+    generator::Options imageOptions(uint32_t width, uint32_t height, uint64_t frames = 1) {
+        generator::Options options;
+        options.width = width;
+        options.height = height;
+        options.frames = frames;
+        return options;
+    }
+
+    // Gradients with grain, so the encoder sees both smooth areas and detail.
+    std::vector<uint8_t> makePixels(uint32_t width, uint32_t height) {
+        std::vector<uint8_t> pixels((size_t) width * height * 3);
+        generator::fillPixels(pixels.data(), width, height, generator::Pattern::GRADIENT, 1, 0);
+        return pixels;
+    }
+
+    std::vector<char> makeCiff(uint32_t width, uint32_t height) {
+        std::vector<char> ciff;
+        generator::makeCiff(imageOptions(width, height), ciff);
+        return ciff;
+    }
+
+    // A generated CAFF in /tmp, removed again when the last reference goes.
+    class TemporaryFile {
+    public:
+        explicit TemporaryFile(const generator::Options &options) {
+            char name[] = "/tmp/parser-bench-XXXXXX.caff";
+            int fd = mkstemps(name, 5);
+
+            if (fd < 0) {
+                return;
+            }
+
+            close(fd);
+            path = name;
+
+            if (!generator::writeCaffFile(path, options)) {
+                unlink(name);
+                path.clear();
+            }
+        }
+
+        ~TemporaryFile() {
+            if (!path.empty()) {
+                unlink(path.c_str());
+            }
+        }
+
+        TemporaryFile(const TemporaryFile &) = delete;
+        TemporaryFile &operator=(const TemporaryFile &) = delete;
+
+        const std::string &name() const { return path; }
+
+    private:
+        std::string path;
+    };
+
+    // Quantized coefficients as a photo at normal quality gives them: a wandering DC value and a few small AC values
+    // that get rarer towards the high frequencies.
+    std::vector<jpge::int16> makeCoefficients(int blocks) {
+        std::vector<jpge::int16> coefficients((size_t) blocks * 64, 0);
+        uint32_t noise = 777;
+        int dc = 0;
+
+        for (int b = 0; b < blocks; b++) {
+            jpge::int16 *block = coefficients.data() + (size_t) b * 64;
+            noise = noise * 1103515245u + 12345u;
+            dc += (int) ((noise >> 16) % 21) - 10;
+            block[0] = (jpge::int16) dc;
+
+            for (int i = 1; i < 64; i++) {
+                noise = noise * 1103515245u + 12345u;
+
+                if ((noise >> 16) % 64 < (uint32_t) (64 - i) / 3) {
+                    block[i] = (jpge::int16) ((int) ((noise >> 8) % 15) - 7);
+                }
+            }
+        }
+
+        return coefficients;
+    }
+
+    class NullStream : public jpge::output_stream {
+    public:
+        bool put_buf(const void *, int len) override {
+            bytes += (uint64_t) len;
+            return true;
+        }
+
+        uint64_t bytes = 0;
+    };
+
+    // Parses path once and fails the run unless exactly one buffer of frameSize bytes was allocated per distinct frame,
+    // i.e. neither building the animations nor growing the vector holding them copied any frame a second time, and
+    // repeated frames share the pixels of their first occurrence.
+    void checkFrameCopies(const std::string &path, size_t frameSize, uint64_t frames, uint64_t distinctFrames) {
+        watchedAllocations = 0;
+        watchedSize = frameSize;
+
+        {
+            parser::CAFF caff;
+
+            if (!parser::parseCaffFile(path, caff)) {
+                printf("%s: %s\n", path.c_str(), parser::errorMessage(parser::parseError().code));
+                failed = true;
+            }
+        }
+
+        watchedSize = 0;
+
+        if (watchedAllocations != distinctFrames) {
+            printf("Parsing a CAFF of %llu frames, %llu of them distinct, copied frame pixels %llu times.\n",
+                   (unsigned long long) frames, (unsigned long long) distinctFrames, (unsigned long long) watchedAllocations.load());
+            failed = true;
+        }
+    }
+
+    void addBenchmarks(std::vector<Benchmark> &benchmarks) {
+        benchmarks.push_back({"datacopy/4K", "frames", []() {
+            auto ciff = std::make_shared<std::vector<char>>(makeCiff(size4k.width, size4k.height));
+            auto target = std::make_shared<std::vector<char>>((size_t) size4k.width * size4k.height * 3);
+
+            return [ciff, target](Run &run) {
+                for (uint64_t i = 0; i < run.iterations; i++) {
+                    uint64_t pos = ciff->size() - target->size();
+                    parser::datacopy(target->data(), parser::ByteSpan(*ciff), pos, target->size());
+                    keep(target->data());
+                }
+
+                run.bytes = run.iterations * target->size();
+                run.items = run.iterations;
+            };
+        }});
+
+        for (const ImageSize &size : {tiny, size4k, size16k}) {
+            benchmarks.push_back({std::string("parseCiff/") + size.name, "frames", [size]() {
+                auto input = std::make_shared<std::vector<char>>(makeCiff(size.width, size.height));
+
+                return [input](Run &run) {
+                    parser::CIFF ciff;
+
+                    for (uint64_t i = 0; i < run.iterations; i++) {
+                        uint64_t pos = 0;
+                        parser::parseCiff(parser::ByteSpan(*input), pos, ciff);
+                        keep(ciff.pixels->data());
+                    }
+
+                    run.bytes = run.iterations * input->size();
+                    run.items = run.iterations;
+                };
+            }});
+        }
+
+        struct CaffInput {
+            const char *name;
+            ImageSize size;
+            uint64_t frames;
+            uint64_t distinctFrames;  // 0 for all distinct, as in generator::Options.
+
+            generator::Options options() const {
+                generator::Options options = imageOptions(size.width, size.height, frames);
+                options.distinctFrames = distinctFrames;
+                return options;
+            }
+        };
+
+        for (const CaffInput &input : {CaffInput{"tiny", tiny, 1, 0}, CaffInput{"4K", size4k, 1, 0},
+                                       CaffInput{"many-frame", {"", 64, 64}, 10000, 0},
+                                       CaffInput{"repeated-frame", {"", 64, 64}, 10000, 10}}) {
+            benchmarks.push_back({std::string("parseCaffFile/") + input.name, "frames", [input]() {
+                const generator::Options options = input.options();
+                auto file = std::make_shared<TemporaryFile>(options);
+                const uint64_t bytes = generator::caffSize(options);
+                checkFrameCopies(file->name(), (size_t) input.size.width * input.size.height * 3, input.frames,
+                                 input.distinctFrames > 0 ? std::min(input.distinctFrames, input.frames) : input.frames);
+
+                return [file, bytes, input](Run &run) {
+                    for (uint64_t i = 0; i < run.iterations; i++) {
+                        parser::CAFF caff;
+                        parser::parseCaffFile(file->name(), caff);
+                        keep(caff.animations.data());
+                    }
+
+                    run.bytes = run.iterations * bytes;
+                    run.items = run.iterations * input.frames;
+                };
+            }});
+
+            benchmarks.push_back({std::string("validateCaffFile/") + input.name, "frames", [input]() {
+                const generator::Options options = input.options();
+                auto file = std::make_shared<TemporaryFile>(options);
+                const uint64_t bytes = generator::caffSize(options);
+
+                return [file, bytes, input](Run &run) {
+                    for (uint64_t i = 0; i < run.iterations; i++) {
+                        parser::VALIDATION verdict = parser::validateCaffFile(file->name());
+                        keep(&verdict);
+                    }
+
+                    run.bytes = run.iterations * bytes;
+                    run.items = run.iterations * input.frames;
+                };
+            }});
+        }
+
+        benchmarks.push_back({"RGB_to_YCC/4K", "frames", []() {
+            auto pixels = std::make_shared<std::vector<uint8_t>>(makePixels(size4k.width, size4k.height));
+            auto converted = std::make_shared<std::vector<uint8_t>>((size_t) size4k.width * 3);
+
+            return [pixels, converted](Run &run) {
+                for (uint64_t i = 0; i < run.iterations; i++) {
+                    for (uint32_t y = 0; y < size4k.height; y++) {
+                        jpge::bench::rgb_to_ycc(converted->data(), pixels->data() + (size_t) y * size4k.width * 3, (int) size4k.width);
+                    }
+                    keep(converted->data());
+                }
+
+                run.bytes = run.iterations * pixels->size();
+                run.items = run.iterations;
+            };
+        }});
+
+        benchmarks.push_back({"DCT2D", "blocks", []() {
+            auto blocks = std::make_shared<std::vector<jpge::int32>>(1024 * 64);
+
+            for (size_t i = 0; i < blocks->size(); i++) {
+                (*blocks)[i] = (jpge::int32) ((i * 37) % 256) - 128;
+            }
+
+            return [blocks](Run &run) {
+                std::vector<jpge::int32> block(64);
+
+                for (uint64_t i = 0; i < run.iterations; i++) {
+                    for (size_t b = 0; b < blocks->size(); b += 64) {
+                        std::memcpy(block.data(), blocks->data() + b, 64 * sizeof(jpge::int32));
+                        jpge::bench::dct_2d(block.data());
+                        keep(block.data());
+                    }
+                }
+
+                run.bytes = run.iterations * blocks->size() * sizeof(jpge::int32);
+                run.items = run.iterations * blocks->size() / 64;
+            };
+        }});
+
+        benchmarks.push_back({"put_bits", "blocks", []() {
+            const int count = 16384;
+            auto coefficients = std::make_shared<std::vector<jpge::int16>>(makeCoefficients(count));
+
+            return [coefficients, count](Run &run) {
+                NullStream stream;
+
+                for (uint64_t i = 0; i < run.iterations; i++) {
+                    jpge::bench::code_blocks(&stream, coefficients->data(), count);
+                }
+
+                // Measured on the coded output, which is what the bit writer produces.
+                run.bytes = stream.bytes;
+                run.items = run.iterations * (uint64_t) count;
+            };
+        }});
+
+        for (const ImageSize &size : {tiny, size4k, size16k}) {
+            benchmarks.push_back({std::string("compress_image_to_jpeg_file/") + size.name, "frames", [size]() {
+                auto pixels = std::make_shared<std::vector<uint8_t>>(makePixels(size.width, size.height));
+
+                return [pixels, size](Run &run) {
+                    for (uint64_t i = 0; i < run.iterations; i++) {
+                        jpge::compress_image_to_jpeg_file("/dev/null", (int) size.width, (int) size.height, 3, pixels->data());
+                    }
+
+                    run.bytes = run.iterations * pixels->size();
+                    run.items = run.iterations;
+                };
+            }});
+        }
+    }
+
+    // Doubles the iteration count until a run takes at least minTime, then reports that run.
+    Run measure(const std::function<void(Run &)> &body, double minTime, double &seconds) {
+        Run run = {1, 0, 0};
+
+        for (;;) {
+            run.bytes = 0;
+            run.items = 0;
+
+            auto start = std::chrono::steady_clock::now();
+            body(run);
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if (seconds >= minTime || run.iterations >= (1ull << 40)) {
+                return run;
+            }
+
+            // Aim a little past minTime, but never grow by more than 10x from a single noisy measurement.
+            double factor = seconds > 0 ? minTime * 1.2 / seconds : 10;
+            run.iterations = (uint64_t) ((double) run.iterations * std::min(std::max(factor, 2.0), 10.0));
+        }
+    }
+
+    void printTime(double seconds) {
+        if (seconds >= 1) {
+            printf("%9.2f s ", seconds);
+        } else if (seconds >= 1e-3) {
+            printf("%9.2f ms", seconds * 1e3);
+        } else if (seconds >= 1e-6) {
+            printf("%9.2f us", seconds * 1e6);
+        } else {
+            printf("%9.2f ns", seconds * 1e9);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string filter;
+    double minTime = 0.5;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            minTime = strtod(argv[++i], nullptr);
+        } else {
+            printf("Usage: bench [--filter text] [--min-time seconds]\n");
+            return -1;
+        }
+    }
+
+    std::vector<Benchmark> benchmarks;
+    addBenchmarks(benchmarks);
+
+    printf("%-36s %12s %12s %12s %14s\n", "Benchmark", "Time/iter", "Iterations", "MB/s", "Items/s");
+
+    for (const Benchmark &benchmark : benchmarks) {
+        if (benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+
+        std::function<void(Run &)> body = benchmark.setup();
+
+        if (failed) {
+            return -1;
+        }
+
+        double seconds;
+        Run run = measure(body, minTime, seconds);
+
+        printf("%-36s ", benchmark.name.c_str());
+        printTime(seconds / (double) run.iterations);
+        printf(" %12llu %12.1f %14.1f %s\n", (unsigned long long) run.iterations, (double) run.bytes / seconds / 1e6,
+               (double) run.items / seconds, (std::string(benchmark.itemName) + "/s").c_str());
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+namespace converter {
+    ThumbnailCache::ThumbnailCache(uint64_t memoryCapacity, std::string directory) :
+        memoryCapacity(memoryCapacity), directory(std::move(directory)), memoryHits(0), diskHits(0), misses(0) {}
+
+    ThumbnailCache::Key ThumbnailCache::keyOf(parser::ByteSpan input, const jpge::params &params, uint32_t maxWidth, uint32_t maxHeight) {
+        // Everything that changes the encoded bytes, at fixed widths so equal parameters always hash equally. They have
+        // a fixed size, so they cannot run into the input.
+        int64_t fields[] = {params.m_quality, params.m_subsampling, params.m_no_chroma_discrim_flag, params.m_two_pass_flag,
+                            params.m_restart_interval, params.m_max_threads, params.m_reduction, maxWidth, maxHeight};
+
+        sha256::Hasher hasher;
+        hasher.update(fields, sizeof(fields));
+        hasher.update(input.data, (size_t) input.size);
+
+        Key key;
+        hasher.finish(key.digest);
+        return key;
+    }
+
+    std::string ThumbnailCache::pathOf(const Key &key) const {
+        static const char hexDigits[] = "0123456789abcdef";
+        std::string name = directory + "/";
+
+        for (uint8_t byte : key.digest) {
+            name += hexDigits[byte >> 4];
+            name += hexDigits[byte & 0xF];
+        }
+
+        return name + ".jpg";
+    }
+
+    // Adds an entry in front of the LRU list, evicting from the back until it fits. Expects mutex to be held.
+    void ThumbnailCache::remember(const Key &key, const std::vector<uint8_t> &jpeg) {
+        if (jpeg.size() > memoryCapacity || entryOf.count(key) != 0) {
+            return;
+        }
+
+        while (memoryUsed + jpeg.size() > memoryCapacity) {
+            memoryUsed -= entries.back().second.size();
+            entryOf.erase(entries.back().first);
+            entries.pop_back();
+        }
+
+        entries.emplace_front(key, jpeg);
+        entryOf[key] = entries.begin();
+        memoryUsed += jpeg.size();
+    }
+
+    bool ThumbnailCache::lookup(const Key &key, std::vector<uint8_t> &jpeg) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = entryOf.find(key);
+
+            if (found != entryOf.end()) {
+                entries.splice(entries.begin(), entries, found->second);
+                jpeg = found->second->second;
+                memoryHits++;
+                return true;
+            }
+        }
+
+        if (!directory.empty()) {
+            std::ifstream file(pathOf(key), std::ifstream::in | std::ifstream::binary);
+
+            if (file) {
+                std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+                if (!file.bad() && !data.empty()) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    remember(key, data);
+                    jpeg.swap(data);
+                    diskHits++;
+                    return true;
+                }
+            }
+        }
+
+        misses++;
+        return false;
+    }
+
+    void ThumbnailCache::store(const Key &key, const std::vector<uint8_t> &jpeg) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            remember(key, jpeg);
+        }
+
+        if (directory.empty() || jpeg.empty()) {
+            return;
+        }
+
+        // Written under a unique temporary name and renamed into place, so concurrent readers and writers (threads or
+        // other processes) only ever see complete files. Failing to persist an entry is not an error.
+        std::string path = pathOf(key);
+        std::string temporaryPath = path + ".XXXXXX";
+        int fd = mkstemp(&temporaryPath[0]);
+
+        if (fd < 0) {
+            return;
+        }
+
+        FILE *file = fdopen(fd, "wb");
+
+        if (file == nullptr) {
+            close(fd);
+            unlink(temporaryPath.c_str());
+            return;
+        }
+
+        bool success = fwrite(jpeg.data(), jpeg.size(), 1, file) == 1;
+        success = (fclose(file) == 0) && success;
+
+        if (!success || rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            unlink(temporaryPath.c_str());
+        }
+    }
+
+    ThumbnailCache::Stats ThumbnailCache::stats() const {
+        return Stats{memoryHits, diskHits, misses};
+    }
+}
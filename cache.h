@@ -0,0 +1,80 @@
+#ifndef PARSER_CACHE_H
+#define PARSER_CACHE_H
+
+#include "jpge.h"
+#include "parser.h"
+#include "sha256.h"
+
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace converter {
+    // Encoded JPEGs keyed by the contents of the input file and the encoder parameters. The most recently used ones
+    // are kept in memory up to memoryCapacity bytes. If a directory is given, every entry is also stored there as a
+    // file, so hits survive restarts. Keys are SHA-256 digests, so inputs from different users can share a cache
+    // without one being able to craft an input that is served another's output. All methods are thread safe.
+    class ThumbnailCache {
+    public:
+        // SHA-256 of the encoder parameters followed by the input file.
+        struct Key {
+            uint8_t digest[sha256::digestSize];
+
+            bool operator==(const Key &other) const {
+                return std::memcmp(digest, other.digest, sizeof(digest)) == 0;
+            }
+        };
+
+        struct Stats {
+            uint64_t memoryHits;
+            uint64_t diskHits;
+            uint64_t misses;
+        };
+
+        explicit ThumbnailCache(uint64_t memoryCapacity, std::string directory = "");
+
+        ThumbnailCache(const ThumbnailCache &) = delete;
+        ThumbnailCache &operator=(const ThumbnailCache &) = delete;
+
+        // maxWidth and maxHeight are the thumbnail size limits the output was made with.
+        static Key keyOf(parser::ByteSpan input, const jpge::params &params, uint32_t maxWidth, uint32_t maxHeight);
+
+        bool lookup(const Key &key, std::vector<uint8_t> &jpeg);
+
+        void store(const Key &key, const std::vector<uint8_t> &jpeg);
+
+        Stats stats() const;
+
+    private:
+        struct KeyHash {
+            size_t operator()(const Key &key) const {
+                size_t hash;
+                std::memcpy(&hash, key.digest, sizeof(hash));
+                return hash;
+            }
+        };
+
+        typedef std::list<std::pair<Key, std::vector<uint8_t>>> EntryList;
+
+        std::string pathOf(const Key &key) const;
+        void remember(const Key &key, const std::vector<uint8_t> &jpeg);
+
+        const uint64_t memoryCapacity;
+        const std::string directory;
+
+        std::mutex mutex;
+        EntryList entries; // Most recently used first.
+        std::unordered_map<Key, EntryList::iterator, KeyHash> entryOf;
+        uint64_t memoryUsed = 0;
+
+        std::atomic<uint64_t> memoryHits;
+        std::atomic<uint64_t> diskHits;
+        std::atomic<uint64_t> misses;
+    };
+}
+
+#endif //PARSER_CACHE_H
@@ -0,0 +1,137 @@
+#include "generator.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static void printUsage() {
+    printf("Usage: caffgen [-ciff] [-size WxH] [-frames n] [-distinct n] [-creator length] [-duration ms]\n");
+    printf("               [-pattern noise | gradient | solid] [-seed n] [-count n] output-path\n");
+}
+
+static bool parseNumber(const char *text, uint64_t &value) {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+
+    if (end == text || *end != '\0' || errno != 0 || text[0] == '-') {
+        return false;
+    }
+
+    value = number;
+    return true;
+}
+
+static bool parseSize(const char *text, uint64_t &width, uint64_t &height) {
+    const char *x = strchr(text, 'x');
+
+    if (x == nullptr) {
+        return false;
+    }
+
+    return parseNumber(std::string(text, x).c_str(), width) && parseNumber(x + 1, height);
+}
+
+static bool parsePattern(const std::string &text, generator::Pattern &pattern) {
+    if (text == "noise") {
+        pattern = generator::Pattern::NOISE;
+    } else if (text == "gradient") {
+        pattern = generator::Pattern::GRADIENT;
+    } else if (text == "solid") {
+        pattern = generator::Pattern::SOLID;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Name of file number index of a corpus: the number goes before the extension, "out.caff" becomes "out_007.caff".
+static std::string corpusFileName(const std::string &path, size_t digits, uint64_t index) {
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = path.size();
+    }
+
+    std::string number = std::to_string(index);
+    number.insert(0, digits > number.size() ? digits - number.size() : 0, '0');
+    return path.substr(0, dot) + "_" + number + path.substr(dot);
+}
+
+int main(int argc, char** argv)
+{
+    generator::Options options;
+    bool ciff = false;
+    uint64_t count = 1;
+    std::string path;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool valid = true;
+
+        if (arg == "-ciff") {
+            ciff = true;
+        } else if (arg == "-size" && i + 1 < argc) {
+            valid = parseSize(argv[++i], options.width, options.height);
+        } else if (arg == "-frames" && i + 1 < argc) {
+            valid = parseNumber(argv[++i], options.frames);
+        } else if (arg == "-distinct" && i + 1 < argc) {
+            valid = parseNumber(argv[++i], options.distinctFrames);
+        } else if (arg == "-creator" && i + 1 < argc) {
+            valid = parseNumber(argv[++i], options.creatorLength);
+        } else if (arg == "-duration" && i + 1 < argc) {
+            valid = parseNumber(argv[++i], options.duration);
+        } else if (arg == "-pattern" && i + 1 < argc) {
+            valid = parsePattern(argv[++i], options.pattern);
+        } else if (arg == "-seed" && i + 1 < argc) {
+            valid = parseNumber(argv[++i], options.seed);
+        } else if (arg == "-count" && i + 1 < argc) {
+            valid = parseNumber(argv[++i], count) && count > 0;
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            valid = false;
+        }
+
+        if (!valid) {
+            printUsage();
+            return -1;
+        }
+    }
+
+    if (path.empty() || !generator::validOptions(options)) {
+        printUsage();
+        return -1;
+    }
+
+    size_t digits = 1;
+    for (uint64_t last = count - 1; last >= 10; last /= 10) {
+        digits++;
+    }
+
+    const uint64_t fileSize = ciff ? generator::ciffSize(options) : generator::caffSize(options);
+    const uint64_t firstSeed = options.seed;
+    auto start = std::chrono::steady_clock::now();
+
+    // Files of a corpus differ by their seed, so they do not all have the same pixels.
+    for (uint64_t i = 0; i < count; i++) {
+        std::string filePath = count == 1 ? path : corpusFileName(path, digits, i);
+        options.seed = firstSeed + i;
+
+        if (!(ciff ? generator::writeCiffFile(filePath, options) : generator::writeCaffFile(filePath, options))) {
+            printf("Failed to write %s.\n", filePath.c_str());
+            return -1;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double bytes = (double) fileSize * (double) count;
+    printf("Wrote %llu file(s), %.0f bytes in %.2f s (%.1f MB/s)\n", (unsigned long long) count, bytes, seconds,
+           seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "caffstream.h"
+
+#include "stats.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace parser {
+    CaffStreamParser::CaffStreamParser(Callbacks callbacks) : callbacks(std::move(callbacks)) {}
+
+    bool CaffStreamParser::fail(ErrorCode code, uint64_t offset) {
+        state = State::Failed;
+        pending.clear();
+        return setParseError(code, offset, blockIndex);
+    }
+
+    // Moves an error reported by a block parser from the block's own offsets to those of the stream.
+    bool CaffStreamParser::failInBlock() {
+        return fail(parseError().code, unitOffset + parseError().offset);
+    }
+
+    bool CaffStreamParser::parseBlockHeader(ByteSpan blockHeader) {
+        uint64_t pos = 0;
+
+        if (!datacopy(&blockId, blockHeader, pos, sizeof(blockId)) ||
+            !datacopy(&blockLength, blockHeader, pos, sizeof(blockLength))) {
+            return fail(ErrorCode::TRUNCATED, unitOffset + pos);
+        }
+
+        if (blockIndex == 0) {
+            if (blockId != 0x1) {
+                return fail(ErrorCode::INVALID_BLOCK_ID, unitOffset);
+            }
+
+            // The header block has a fixed size, do not buffer a bogus length before rejecting it.
+            if (blockLength != sizeof(CAFF_HEADER::magic) + sizeof(CAFF_HEADER::header_size) + sizeof(CAFF_HEADER::num_anim)) {
+                return fail(ErrorCode::INVALID_BLOCK_LENGTH, unitOffset + blockHeaderSize);
+            }
+        } else if (blockIndex == 1 && blockId != 0x2 && numAnim == 0) {
+            state = State::Done;
+            return true;
+        } else if (!(blockIndex == 1 && blockId == 0x2) && blockId != 0x3) {
+            return fail(ErrorCode::INVALID_BLOCK_ID, unitOffset);
+        }
+
+        state = State::BlockBody;
+
+        if (blockLength == 0) {
+            return parseBlock(ByteSpan());
+        }
+
+        return true;
+    }
+
+    bool CaffStreamParser::parseBlock(ByteSpan block) {
+        uint64_t pos = 0;
+
+        if (blockId == 0x1) {
+            CAFF_HEADER header;
+
+            if (!parseCaffHeader(block, blockLength, pos, header)) {
+                return failInBlock();
+            }
+
+            numAnim = header.num_anim;
+
+            if (callbacks.onHeader && !callbacks.onHeader(header)) {
+                return fail(ErrorCode::CANCELLED, unitOffset);
+            }
+        } else if (blockId == 0x2) {
+            CAFF_CREDITS credits;
+
+            if (!parseCaffCredits(block, blockLength, pos, credits)) {
+                return failInBlock();
+            }
+
+            if (callbacks.onCredits && !callbacks.onCredits(credits)) {
+                return fail(ErrorCode::CANCELLED, unitOffset);
+            }
+        } else {
+            CAFF_ANIMATION_VIEW animation;
+
+            if (!parseCaffAnimation(block, blockLength, pos, animation)) {
+                return failInBlock();
+            }
+
+            if (callbacks.onAnimation && !callbacks.onAnimation(animationsParsed, animation)) {
+                return fail(ErrorCode::CANCELLED, unitOffset);
+            }
+
+            animationsParsed++;
+        }
+
+        blockIndex++;
+
+        if (blockIndex >= 2 && animationsParsed == numAnim) {
+            state = State::Done;
+        } else {
+            state = State::BlockHeader;
+        }
+
+        return true;
+    }
+
+    bool CaffStreamParser::feed(const char *data, uint64_t size) {
+        while (size > 0 && (state == State::BlockHeader || state == State::BlockBody)) {
+            uint64_t needed = state == State::BlockHeader ? blockHeaderSize : blockLength;
+
+            // Units that arrive whole are parsed straight from the caller's chunk, only split ones are buffered.
+            ByteSpan unit;
+
+            if (pending.empty() && size >= needed) {
+                unit = ByteSpan(data, needed);
+                data += needed;
+                size -= needed;
+            } else {
+                uint64_t take = needed - pending.size();
+
+                if (take > size) {
+                    take = size;
+                }
+
+                pending.insert(pending.end(), data, data + take);
+                data += take;
+                size -= take;
+
+                if (pending.size() < needed) {
+                    break;
+                }
+
+                unit = ByteSpan(pending);
+            }
+
+            bool ok = state == State::BlockHeader ? parseBlockHeader(unit) : parseBlock(unit);
+
+            pending.clear();
+            unitOffset += needed;
+
+            if (!ok) {
+                return false;
+            }
+        }
+
+        return state != State::Failed;
+    }
+
+    bool CaffStreamParser::finish() {
+        if (state == State::Done) {
+            return true;
+        }
+
+        if (state != State::Failed) {
+            fail(ErrorCode::TRUNCATED, unitOffset + pending.size());
+        }
+
+        return false;
+    }
+
+    bool parseCaffStream(std::istream &in, CaffStreamParser::Callbacks callbacks, uint64_t chunkSize) {
+        CaffStreamParser streamParser(std::move(callbacks));
+        std::vector<char> chunk(chunkSize > 0 ? chunkSize : 1);
+
+        while (!streamParser.done() && in.read(chunk.data(), (std::streamsize) chunk.size()).gcount() > 0) {
+            if (!streamParser.feed(chunk.data(), (uint64_t) in.gcount())) {
+                return false;
+            }
+        }
+
+        return streamParser.finish();
+    }
+
+    bool parseCaffStream(int fd, CaffStreamParser::Callbacks callbacks, uint64_t chunkSize) {
+        CaffStreamParser streamParser(std::move(callbacks));
+        std::vector<char> chunk(chunkSize > 0 ? chunkSize : 1);
+
+        while (!streamParser.done()) {
+            ssize_t got;
+
+            {
+                STATS_TIMER(READ_FILE);
+                got = read(fd, chunk.data(), chunk.size());
+            }
+
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (got < 0) {
+                return setParseError(ErrorCode::READ_FAILED, 0);
+            }
+
+            if (got == 0) {
+                break;
+            }
+
+            if (!streamParser.feed(chunk.data(), (uint64_t) got)) {
+                return false;
+            }
+        }
+
+        return streamParser.finish();
+    }
+}
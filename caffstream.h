@@ -0,0 +1,59 @@
+#ifndef PARSER_CAFFSTREAM_H
+#define PARSER_CAFFSTREAM_H
+
+#include "parser.h"
+
+#include <functional>
+#include <istream>
+
+namespace parser {
+    // Incremental CAFF parser. Input is pushed in arbitrary chunks with feed(), and every block is handed to the
+    // callbacks as soon as it is complete. At most one incomplete block is buffered, so memory stays bounded by
+    // the largest frame instead of the file size. Views passed to onAnimation are only valid during the call.
+    // A callback returning false stops parsing. On failure, parseError() holds offsets into the whole stream.
+    class CaffStreamParser {
+    public:
+        struct Callbacks {
+            std::function<bool(const CAFF_HEADER &)> onHeader;
+            std::function<bool(const CAFF_CREDITS &)> onCredits;
+            std::function<bool(uint64_t index, const CAFF_ANIMATION_VIEW &)> onAnimation;
+        };
+
+        explicit CaffStreamParser(Callbacks callbacks);
+
+        bool feed(const char *data, uint64_t size);
+
+        // Returns true if the input contained a complete CAFF file.
+        bool finish();
+
+        bool done() const { return state == State::Done; }
+        bool failed() const { return state == State::Failed; }
+
+    private:
+        enum class State { BlockHeader, BlockBody, Done, Failed };
+
+        static const uint64_t blockHeaderSize = sizeof(uint8_t) + sizeof(uint64_t);
+
+        bool parseBlockHeader(ByteSpan blockHeader);
+        bool parseBlock(ByteSpan block);
+        bool fail(ErrorCode code, uint64_t offset);
+        bool failInBlock();
+
+        Callbacks callbacks;
+        State state = State::BlockHeader;
+        std::vector<char> pending;
+        uint8_t blockId = 0;
+        uint64_t blockLength = 0;
+        uint64_t blockIndex = 0;
+        uint64_t unitOffset = 0; // Stream offset of the block header or block being assembled.
+        uint64_t numAnim = 0;
+        uint64_t animationsParsed = 0;
+    };
+
+    // Reads input in chunkSize pieces and pushes it through a CaffStreamParser.
+    bool parseCaffStream(std::istream &in, CaffStreamParser::Callbacks callbacks, uint64_t chunkSize = 1 << 16);
+
+    bool parseCaffStream(int fd, CaffStreamParser::Callbacks callbacks, uint64_t chunkSize = 1 << 16);
+}
+
+#endif //PARSER_CAFFSTREAM_H
@@ -0,0 +1,304 @@
+#include "convert.h"
+
+#include "resize.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+
+namespace converter {
+    bool endsWith(std::string const &str, std::string const &suffix) {
+        if (str.length() < suffix.length()) {
+            return false;
+        }
+        return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+    }
+
+    bool fileTypeOf(const std::string &filePath, FileType &fileType) {
+        if (endsWith(filePath, ".caff")) {
+            fileType = FileType::CAFF;
+            return true;
+        }
+
+        if (endsWith(filePath, ".ciff")) {
+            fileType = FileType::CIFF;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool writeFile(const std::string &filePath, const std::vector<uint8_t> &data) {
+        STATS_TIMER(WRITE_OUTPUT);
+        FILE *file = fopen(filePath.c_str(), "wb");
+
+        if (file == nullptr) {
+            return false;
+        }
+
+        bool success = data.empty() || fwrite(data.data(), data.size(), 1, file) == 1;
+        return (fclose(file) == 0) && success;
+    }
+
+    bool writeFile(const std::string &filePath, const jpge::chunk_stream &data) {
+        STATS_TIMER(WRITE_OUTPUT);
+        int fd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        const jpge::uint count = data.get_num_chunks();
+        std::vector<iovec> chunks(std::min<size_t>(count, IOV_MAX));
+        jpge::uint next = 0;
+        size_t skip = 0;
+        bool success = true;
+
+        // Sends up to IOV_MAX chunks per call; after a partial write the next call starts skip bytes into chunk next.
+        while (success && next < count) {
+            size_t used = 0;
+            size_t total = 0;
+
+            for (jpge::uint i = next; i < count && used < chunks.size(); i++, used++) {
+                size_t size;
+                const jpge::uint8 *chunk = data.get_chunk(i, size);
+                const size_t offset = i == next ? skip : 0;
+                chunks[used].iov_base = const_cast<jpge::uint8 *>(chunk + offset);
+                chunks[used].iov_len = size - offset;
+                total += size - offset;
+            }
+
+            ssize_t written = writev(fd, chunks.data(), (int) used);
+
+            if (written < 0) {
+                success = errno == EINTR;
+                continue;
+            }
+
+            if ((size_t) written == total) {
+                next += (jpge::uint) used;
+                skip = 0;
+                continue;
+            }
+
+            for (size_t left = (size_t) written; left > 0; ) {
+                size_t size;
+                data.get_chunk(next, size);
+                const size_t remaining = size - skip;
+
+                if (left < remaining) {
+                    skip += left;
+                    left = 0;
+                } else {
+                    left -= remaining;
+                    next++;
+                    skip = 0;
+                }
+            }
+        }
+
+        return (close(fd) == 0) && success;
+    }
+
+    std::string parseErrorMessage(const char *what) {
+        const parser::PARSE_ERROR &error = parser::parseError();
+        char message[256];
+        snprintf(message, sizeof(message), "Failed to parse %s: %s at offset %llu (block %llu).", what,
+                 parser::errorMessage(error.code), (unsigned long long) error.offset, (unsigned long long) error.block);
+        return message;
+    }
+
+    void printParseError(const char *what) {
+        printf("%s\n", parseErrorMessage(what).c_str());
+    }
+
+    // Finds the image to convert in the bytes of the input: the CIFF itself or the first frame of the CAFF.
+    static bool loadImage(FileType fileType, parser::ByteSpan bytes, Context &context, parser::CIFF_VIEW &ciff) {
+        if (fileType == FileType::CAFF) {
+            if (!parser::indexCaff(bytes, context.index)) {
+                context.error = parseErrorMessage("CAFF file");
+                return false;
+            }
+
+            if (context.index.frames.empty()) {
+                context.error = "CAFF file has no CIFF image.";
+                return false;
+            }
+
+            if (!parser::loadCaffFrame(bytes, context.index.frames[0], ciff)) {
+                context.error = parseErrorMessage("first CIFF image of CAFF file");
+                return false;
+            }
+        } else {
+            uint64_t pos = 0;
+
+            if (!parser::parseCiff(bytes, pos, ciff)) {
+                context.error = parseErrorMessage("CIFF file");
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Returns the jpge::params::m_reduction giving exactly resizedWidth x resizedHeight, or 1 if there is none.
+    static jpge::uint encoderReduction(uint32_t width, uint32_t height, uint32_t resizedWidth, uint32_t resizedHeight) {
+        for (jpge::uint reduction = 8; reduction > 1; reduction /= 2) {
+            if ((width + reduction - 1) / reduction == resizedWidth && (height + reduction - 1) / reduction == resizedHeight) {
+                return reduction;
+            }
+        }
+
+        return 1;
+    }
+
+    bool convertFile(FileType fileType, std::string filePath, Context &context) {
+        parser::MappedFile file;
+        parser::CIFF_VIEW ciff;
+
+        if (!file.open(filePath)) {
+            context.error = fileType == FileType::CAFF ? "Failed to open CAFF file." : "Failed to open CIFF file.";
+            return false;
+        }
+
+        filePath.erase(filePath.length()-5);
+        filePath = filePath + ".jpg";
+
+        ThumbnailCache::Key key;
+
+        if (context.cache != nullptr) {
+            key = ThumbnailCache::keyOf(file.bytes(), context.params, context.maxWidth, context.maxHeight);
+
+            if (context.cache->lookup(key, context.jpeg)) {
+                if (!writeFile(filePath, context.jpeg)) {
+                    context.error = "Unexpected error while saving CIFF image as JPG.";
+                    return false;
+                }
+                return true;
+            }
+        }
+
+        if (!loadImage(fileType, file.bytes(), context, ciff)) {
+            return false;
+        }
+
+        if (ciff.width > INT_MAX || ciff.height > INT_MAX) {
+            context.error = "Error while saving JPG: CIFF image size too large.";
+            return false;
+        }
+
+        uint32_t width;
+        uint32_t height;
+        fitWithin((uint32_t) ciff.width, (uint32_t) ciff.height, context.maxWidth, context.maxHeight, width, height);
+        const bool resized = width != ciff.width || height != ciff.height;
+
+        if (context.cache == nullptr && !resized) {
+            if (!jpge::compress_image_to_jpeg_file(context.encoder, filePath.c_str(), (int)ciff.width, (int)ciff.height, 3, (const jpge::uint8*)(ciff.pixels), context.params)) {
+                context.error = "Unexpected error while saving CIFF image as JPG.";
+                return false;
+            }
+            return true;
+        }
+
+        // Encoded in memory first, so the same bytes can go to both the output file and the cache.
+        jpge::chunk_stream &stream = context.output;
+        stream.clear();
+        bool encoded;
+
+        // A size the encoder can reduce to by itself is averaged while it loads the image, which is cheaper than
+        // resizing first and keeps striped parallel encoding.
+        jpge::params params(context.params);
+        params.m_reduction = resized ? encoderReduction((uint32_t) ciff.width, (uint32_t) ciff.height, width, height) : 1;
+
+        if (resized && params.m_reduction == 1) {
+            encoded = encodeResized(context.encoder, stream, (const uint8_t *)(ciff.pixels), (uint32_t) ciff.width, (uint32_t) ciff.height,
+                                    width, height, params);
+        } else {
+            encoded = context.encoder.init(&stream, (int)ciff.width, (int)ciff.height, 3, params) &&
+                      context.encoder.process_image((const jpge::uint8*)(ciff.pixels));
+            context.encoder.reset();
+        }
+
+        if (!encoded || !writeFile(filePath, stream)) {
+            context.error = "Unexpected error while saving CIFF image as JPG.";
+            return false;
+        }
+
+        if (context.cache != nullptr) {
+            context.jpeg.clear();
+
+            for (jpge::uint i = 0; i < stream.get_num_chunks(); i++) {
+                size_t size;
+                const jpge::uint8 *chunk = stream.get_chunk(i, size);
+                context.jpeg.insert(context.jpeg.end(), chunk, chunk + size);
+            }
+
+            context.cache->store(key, context.jpeg);
+        }
+        return true;
+    }
+
+    bool convertBatch(const std::vector<std::string> &filePaths, unsigned jobs, const Context &settings) {
+        if (jobs == 0) {
+            jobs = 1;
+        }
+
+        if (jobs > filePaths.size()) {
+            jobs = (unsigned) std::max<size_t>(filePaths.size(), 1);
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<size_t> failed(0);
+        std::mutex reportMutex;
+
+        auto work = [&]() {
+            std::unique_ptr<Context> context(new Context());
+            context->params = settings.params;
+            context->cache = settings.cache;
+            context->maxWidth = settings.maxWidth;
+            context->maxHeight = settings.maxHeight;
+
+            for (size_t i = next++; i < filePaths.size(); i = next++) {
+                FileType fileType;
+                bool success = false;
+
+                if (!fileTypeOf(filePaths[i], fileType)) {
+                    context->error = "Unknown file type.";
+                } else {
+                    success = convertFile(fileType, filePaths[i], *context);
+                }
+
+                std::lock_guard<std::mutex> lock(reportMutex);
+
+                if (success) {
+                    printf("OK %s\n", filePaths[i].c_str());
+                } else {
+                    failed++;
+                    printf("FAILED %s: %s\n", filePaths[i].c_str(), context->error.c_str());
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+
+        for (unsigned i = 1; i < jobs; i++) {
+            workers.emplace_back(work);
+        }
+
+        work();
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        return failed == 0;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef PARSER_CONVERT_H
+#define PARSER_CONVERT_H
+
+#include "cache.h"
+#include "jpge.h"
+#include "parser.h"
+
+#include <string>
+#include <vector>
+
+namespace converter {
+    enum class FileType { CAFF, CIFF };
+
+    // State kept by one converting thread and reused for every file it handles.
+    struct Context {
+        jpge::jpeg_encoder encoder;
+        jpge::params params;
+        parser::CAFF_INDEX index;
+        // Optional, shared between threads. When set, convertFile() looks the input up before parsing it.
+        ThumbnailCache *cache = nullptr;
+        // Larger images are scaled down to fit, keeping the aspect ratio. 0 means no limit.
+        uint32_t maxWidth = 0;
+        uint32_t maxHeight = 0;
+        // Encoder output, written to the file straight from its chunks.
+        jpge::chunk_stream output;
+        std::vector<uint8_t> jpeg;
+        // Why the last convertFile() call failed. convertFile() does not print it, so callers can report it together
+        // with the path.
+        std::string error;
+    };
+
+    // Collects the encoder output in memory.
+    class VectorStream : public jpge::output_stream {
+    public:
+        explicit VectorStream(std::vector<uint8_t> &buffer) : buffer(buffer) {}
+
+        bool put_buf(const void *data, int len) override {
+            const uint8_t *bytes = static_cast<const uint8_t *>(data);
+            buffer.insert(buffer.end(), bytes, bytes + len);
+            return true;
+        }
+
+    private:
+        std::vector<uint8_t> &buffer;
+    };
+
+    bool endsWith(std::string const &str, std::string const &suffix);
+
+    // Describes parser::parseError() for a failure to parse what.
+    std::string parseErrorMessage(const char *what);
+
+    // Prints parseErrorMessage(what).
+    void printParseError(const char *what);
+
+    bool writeFile(const std::string &filePath, const std::vector<uint8_t> &data);
+
+    // Writes the chunks of the stream with writev(), without joining them first.
+    bool writeFile(const std::string &filePath, const jpge::chunk_stream &data);
+
+    // Derives the file type from a .caff / .ciff extension.
+    bool fileTypeOf(const std::string &filePath, FileType &fileType);
+
+    // Writes the CIFF image (or the first frame of the CAFF animation) next to the input as .jpg. On failure returns
+    // false with the reason in context.error.
+    bool convertFile(FileType fileType, std::string filePath, Context &context);
+
+    // Converts every file on a pool of jobs worker threads, each with its own Context that copies params, cache and size
+    // limits from settings, and prints one "OK path" / "FAILED path: reason" line per file as it completes. Returns
+    // true if all files were converted.
+    bool convertBatch(const std::vector<std::string> &filePaths, unsigned jobs, const Context &settings);
+}
+
+#endif //PARSER_CONVERT_H
@@ -0,0 +1,299 @@
+#include "frames.h"
+
+#include "avi.h"
+#include "caffstream.h"
+#include "convert.h"
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <unistd.h>
+
+namespace converter {
+    // Pixels of recently seen distinct frames kept around to recognise repeats.
+    static const uint64_t repeatDetectionBytes = 128 << 20;
+
+    namespace {
+        // One frame copied out of the parser's buffer, since animation views only live during the callback.
+        struct Frame {
+            uint64_t index;
+            uint64_t duration;
+            uint64_t width;
+            uint64_t height;
+            std::shared_ptr<const std::vector<char>> pixels;
+        };
+
+        // Recognises frames repeating an earlier one: the pixel hash from the parser picks the candidates, which are
+        // then compared in full. Pixels are shared with the queued frames, and the oldest distinct frames are
+        // forgotten once more than budget bytes are held.
+        class RepeatDetector {
+        public:
+            explicit RepeatDetector(uint64_t budget) : budget(budget) {}
+
+            // Returns the index of the earlier frame equal to frame, or frame.index if there is none.
+            uint64_t match(const Frame &frame, uint64_t pixelHash) {
+                auto candidates = frames.equal_range(pixelHash);
+
+                for (auto it = candidates.first; it != candidates.second; ++it) {
+                    const Frame &earlier = it->second;
+
+                    if (earlier.width == frame.width && earlier.height == frame.height && *earlier.pixels == *frame.pixels) {
+                        return earlier.index;
+                    }
+                }
+
+                frames.emplace(pixelHash, frame);
+                order.emplace_back(pixelHash, frame.index);
+                held += frame.pixels->size();
+
+                while (held > budget && order.size() > 1) {
+                    candidates = frames.equal_range(order.front().first);
+
+                    for (auto it = candidates.first; it != candidates.second; ++it) {
+                        if (it->second.index == order.front().second) {
+                            held -= it->second.pixels->size();
+                            frames.erase(it);
+                            break;
+                        }
+                    }
+
+                    order.pop_front();
+                }
+
+                return frame.index;
+            }
+
+        private:
+            const uint64_t budget;
+            uint64_t held = 0;
+            std::unordered_multimap<uint64_t, Frame> frames;
+            std::deque<std::pair<uint64_t, uint64_t>> order;
+        };
+
+        // Bounded hand-off from the parsing thread to the encoders. push() blocks while the queue is full, which
+        // keeps the number of frames held in memory independent of the animation length.
+        class FrameQueue {
+        public:
+            explicit FrameQueue(size_t capacity) : capacity(capacity) {}
+
+            void push(std::unique_ptr<Frame> frame) {
+                std::unique_lock<std::mutex> lock(mutex);
+                notFull.wait(lock, [&]() { return frames.size() < capacity; });
+                frames.push(std::move(frame));
+                notEmpty.notify_one();
+            }
+
+            // Returns nullptr once the queue is closed and drained.
+            std::unique_ptr<Frame> pop() {
+                std::unique_lock<std::mutex> lock(mutex);
+                notEmpty.wait(lock, [&]() { return !frames.empty() || closed; });
+
+                if (frames.empty()) {
+                    return nullptr;
+                }
+
+                std::unique_ptr<Frame> frame = std::move(frames.front());
+                frames.pop();
+                notFull.notify_one();
+                return frame;
+            }
+
+            void close() {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                notEmpty.notify_all();
+            }
+
+        private:
+            const size_t capacity;
+            std::mutex mutex;
+            std::condition_variable notFull;
+            std::condition_variable notEmpty;
+            std::queue<std::unique_ptr<Frame>> frames;
+            bool closed = false;
+        };
+    }
+
+    static bool encodeFrame(jpge::jpeg_encoder &encoder, const jpge::params &params, const Frame &frame, std::vector<uint8_t> &jpeg) {
+        if (frame.width > INT_MAX || frame.height > INT_MAX) {
+            return false;
+        }
+
+        jpeg.clear();
+        VectorStream stream(jpeg);
+        bool success = encoder.init(&stream, (int) frame.width, (int) frame.height, 3, params) &&
+                       encoder.process_image((const jpge::uint8 *) frame.pixels->data());
+        encoder.reset();
+        return success;
+    }
+
+    static bool copyFile(const std::string &from, const std::string &to) {
+        std::ifstream in(from, std::ifstream::in | std::ifstream::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return !in.bad() && writeFile(to, data);
+    }
+
+    static std::string frameFileName(const std::string &baseName, int digits, uint64_t index) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%0*llu.jpg", digits, (unsigned long long) index);
+        return baseName + suffix;
+    }
+
+    bool exportFrames(std::string filePath, FrameFormat format, unsigned jobs, const jpge::params &params) {
+        if (jobs == 0) {
+            jobs = 1;
+        }
+
+        int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            printf("Failed to open CAFF file.\n");
+            return false;
+        }
+
+        filePath.erase(filePath.length()-5);
+
+        // Frames are encoded side by side already, so each one gets a single thread.
+        jpge::params frameParams(params);
+        frameParams.m_max_threads = 1;
+
+        FrameQueue queue(2 * (size_t) jobs);
+        std::atomic<bool> success(true);
+        std::mutex aviMutex;
+        std::vector<AviFrame> aviFrames;
+        RepeatDetector repeatDetector(repeatDetectionBytes);
+        std::vector<std::pair<uint64_t, uint64_t>> repeatedFrames;
+        uint64_t width = 0;
+        uint64_t height = 0;
+        int digits = 1;
+
+        auto encode = [&]() {
+            std::unique_ptr<jpge::jpeg_encoder> encoder(new jpge::jpeg_encoder());
+            std::vector<uint8_t> jpeg;
+
+            for (std::unique_ptr<Frame> frame = queue.pop(); frame; frame = queue.pop()) {
+                if (!success) {
+                    continue;
+                }
+
+                if (!encodeFrame(*encoder, frameParams, *frame, jpeg)) {
+                    printf("Failed to encode frame %llu of CAFF file.\n", (unsigned long long) frame->index);
+                    success = false;
+                    continue;
+                }
+
+                if (format == FrameFormat::JPEG_SEQUENCE) {
+                    if (!writeFile(frameFileName(filePath, digits, frame->index), jpeg)) {
+                        printf("Failed to write JPG file for frame %llu.\n", (unsigned long long) frame->index);
+                        success = false;
+                    }
+                } else {
+                    std::lock_guard<std::mutex> lock(aviMutex);
+
+                    if (aviFrames.size() <= frame->index) {
+                        aviFrames.resize(frame->index + 1);
+                    }
+
+                    aviFrames[frame->index].jpeg.swap(jpeg);
+                    aviFrames[frame->index].duration = frame->duration;
+                    aviFrames[frame->index].same_as = frame->index;
+                }
+            }
+        };
+
+        parser::CaffStreamParser::Callbacks callbacks;
+
+        callbacks.onHeader = [&](const parser::CAFF_HEADER &header) {
+            for (uint64_t last = header.num_anim > 0 ? header.num_anim - 1 : 0; last >= 10; last /= 10) {
+                digits++;
+            }
+            return true;
+        };
+
+        callbacks.onAnimation = [&](uint64_t index, const parser::CAFF_ANIMATION_VIEW &animation) {
+            if (index == 0) {
+                width = animation.ciff.width;
+                height = animation.ciff.height;
+            } else if (format == FrameFormat::MJPEG_AVI && (animation.ciff.width != width || animation.ciff.height != height)) {
+                // An AVI stream has a single frame size, which players use for every frame.
+                printf("Frame %llu of CAFF file is %llux%llu but frame 0 is %llux%llu; AVI output needs frames of one size.\n",
+                       (unsigned long long) index, (unsigned long long) animation.ciff.width, (unsigned long long) animation.ciff.height,
+                       (unsigned long long) width, (unsigned long long) height);
+                success = false;
+                return false;
+            }
+
+            std::unique_ptr<Frame> frame(new Frame{index, animation.duration, animation.ciff.width, animation.ciff.height,
+                                                   std::make_shared<const std::vector<char>>(animation.ciff.pixels, animation.ciff.pixels + animation.ciff.content_size)});
+            uint64_t sameAs = repeatDetector.match(*frame, animation.pixel_hash);
+
+            // A repeated frame is not encoded again, it reuses the output of the frame it repeats.
+            if (sameAs != index) {
+                if (format == FrameFormat::JPEG_SEQUENCE) {
+                    repeatedFrames.emplace_back(index, sameAs);
+                } else {
+                    std::lock_guard<std::mutex> lock(aviMutex);
+
+                    if (aviFrames.size() <= index) {
+                        aviFrames.resize(index + 1);
+                    }
+
+                    aviFrames[index].duration = animation.duration;
+                    aviFrames[index].same_as = sameAs;
+                }
+                return (bool) success;
+            }
+
+            queue.push(std::move(frame));
+            return (bool) success;
+        };
+
+        std::vector<std::thread> workers;
+
+        for (unsigned i = 0; i < jobs; i++) {
+            workers.emplace_back(encode);
+        }
+
+        if (!parser::parseCaffStream(fd, callbacks)) {
+            if (success) {
+                printParseError("CAFF file");
+            }
+            success = false;
+        }
+
+        queue.close();
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        ::close(fd);
+
+        if (!success) {
+            return false;
+        }
+
+        if (format == FrameFormat::MJPEG_AVI) {
+            return writeMjpegAvi(filePath + ".avi", (uint32_t) width, (uint32_t) height, aviFrames);
+        }
+
+        for (const std::pair<uint64_t, uint64_t> &repeated : repeatedFrames) {
+            if (!copyFile(frameFileName(filePath, digits, repeated.second), frameFileName(filePath, digits, repeated.first))) {
+                printf("Failed to write JPG file for frame %llu.\n", (unsigned long long) repeated.first);
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef PARSER_FRAMES_H
+#define PARSER_FRAMES_H
+
+#include "jpge.h"
+
+#include <string>
+
+namespace converter {
+    enum class FrameFormat { JPEG_SEQUENCE, MJPEG_AVI };
+
+    // Encodes every frame of a CAFF file, either as numbered JPEGs (name_00.jpg, name_01.jpg, ...) or as one
+    // Motion-JPEG name.avi that keeps the frame durations. The file is read by the streaming parser while jobs
+    // worker threads encode the frames parsed so far, so parsing frame N+1 overlaps with encoding frame N.
+    bool exportFrames(std::string filePath, FrameFormat format, unsigned jobs, const jpge::params &params);
+}
+
+#endif //PARSER_FRAMES_H
@@ -0,0 +1,418 @@
+#include "generator.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <unistd.h>
+
+namespace generator {
+    // Distinct images of a CAFF are kept for its repeated frames while they take up no more than this.
+    static const uint64_t repeatCacheBytes = 256 << 20;
+
+    static const uint64_t ciffFixedHeaderSize = 4 + 8 + 8 + 8 + 8;
+    static const uint64_t caffHeaderSize = 4 + 8 + 8;
+    static const uint64_t creditsFixedSize = 2 + 1 + 1 + 1 + 1 + 8;
+    static const uint64_t blockHeaderSize = 1 + 8;
+
+    static bool addTo(uint64_t &total, uint64_t value) {
+        if (value > UINT64_MAX - total) {
+            return false;
+        }
+
+        total += value;
+        return true;
+    }
+
+    static bool multiplyTo(uint64_t &total, uint64_t factor) {
+        if (factor != 0 && total > UINT64_MAX / factor) {
+            return false;
+        }
+
+        total *= factor;
+        return true;
+    }
+
+    static uint64_t ciffHeaderSize(const Options &options) {
+        uint64_t size = ciffFixedHeaderSize + options.caption.size() + 1;
+
+        for (const std::string &tag : options.tags) {
+            size += tag.size() + 1;
+        }
+
+        return size;
+    }
+
+    // Sizes of a CIFF and a whole CAFF, or false if they do not fit in 64 bits.
+    static bool sizesOf(const Options &options, uint64_t &ciff, uint64_t &caff) {
+        uint64_t content = options.width;
+
+        if (!multiplyTo(content, options.height) || !multiplyTo(content, 3) || content > SIZE_MAX) {
+            return false;
+        }
+
+        ciff = ciffHeaderSize(options);
+
+        if (!addTo(ciff, content)) {
+            return false;
+        }
+
+        uint64_t frames = ciff;
+
+        if (!addTo(frames, blockHeaderSize + sizeof(options.duration)) || !multiplyTo(frames, options.frames)) {
+            return false;
+        }
+
+        caff = blockHeaderSize + caffHeaderSize + blockHeaderSize + creditsFixedSize;
+        return addTo(caff, options.creatorLength) && addTo(caff, frames);
+    }
+
+    bool validOptions(const Options &options) {
+        uint64_t ciff;
+        uint64_t caff;
+
+        if (options.width == 0 || options.height == 0 || options.frames == 0 ||
+            options.caption.find('\n') != std::string::npos || !sizesOf(options, ciff, caff)) {
+            return false;
+        }
+
+        for (const std::string &tag : options.tags) {
+            if (tag.find('\0') != std::string::npos) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    uint64_t ciffSize(const Options &options) {
+        uint64_t ciff = 0;
+        uint64_t caff = 0;
+        return validOptions(options) && sizesOf(options, ciff, caff) ? ciff : 0;
+    }
+
+    uint64_t caffSize(const Options &options) {
+        uint64_t ciff = 0;
+        uint64_t caff = 0;
+        return validOptions(options) && sizesOf(options, ciff, caff) ? caff : 0;
+    }
+
+    // SplitMix64: a full 64-bit random value from a single add and multiply chain, fast enough for multi-GB output.
+    static inline uint64_t nextRandom(uint64_t &state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    static void fillNoise(uint8_t *pixels, uint64_t size, uint64_t &state) {
+        uint64_t i = 0;
+
+        for (; i + 8 <= size; i += 8) {
+            uint64_t value = nextRandom(state);
+            memcpy(pixels + i, &value, sizeof(value));
+        }
+
+        uint64_t value = nextRandom(state);
+
+        for (; i < size; i++, value >>= 8) {
+            pixels[i] = (uint8_t) value;
+        }
+    }
+
+    // Red rises left to right and green top to bottom, blue along the diagonal, each scrolled by the image number
+    // and overlaid with grain of up to 15 levels.
+    static void fillGradient(uint8_t *pixels, uint64_t width, uint64_t height, uint64_t image, uint64_t &state) {
+        const uint64_t stride = width * 3;
+        std::vector<uint8_t> base(stride);
+
+        for (uint64_t x = 0; x < width; x++) {
+            base[x * 3] = (uint8_t) (x * 256 / width + image);
+            base[x * 3 + 1] = (uint8_t) image;
+            base[x * 3 + 2] = (uint8_t) (x * 128 / width + image * 3);
+        }
+
+        for (uint64_t y = 0; y < height; y++) {
+            uint8_t *row = pixels + y * stride;
+            const uint8_t rowGreen = (uint8_t) (y * 256 / height);
+            const uint8_t rowBlue = (uint8_t) (y * 128 / height);
+
+            for (uint64_t i = 0; i < stride; i += 3) {
+                row[i] = base[i];
+                row[i + 1] = (uint8_t) (base[i + 1] + rowGreen);
+                row[i + 2] = (uint8_t) (base[i + 2] + rowBlue);
+            }
+
+            // Eight bytes at a time: with grain below 0x80 per byte, adding to the low seven bits and restoring the
+            // top bit with an exclusive or wraps every byte on its own.
+            uint64_t i = 0;
+
+            for (; i + 8 <= stride; i += 8) {
+                uint64_t word;
+                memcpy(&word, row + i, sizeof(word));
+                const uint64_t grain = nextRandom(state) & 0x0F0F0F0F0F0F0F0Full;
+                word = ((word & 0x7F7F7F7F7F7F7F7Full) + grain) ^ (word & 0x8080808080808080ull);
+                memcpy(row + i, &word, sizeof(word));
+            }
+
+            for (uint64_t grain = nextRandom(state); i < stride; i++, grain >>= 8) {
+                row[i] = (uint8_t) (row[i] + (grain & 15));
+            }
+        }
+    }
+
+    void fillPixels(uint8_t *pixels, uint64_t width, uint64_t height, Pattern pattern, uint64_t seed, uint64_t image) {
+        uint64_t state = seed ^ (image * 0xD1B54A32D192ED03ull);
+        const uint64_t size = width * height * 3;
+
+        switch (pattern) {
+            case Pattern::NOISE:
+                fillNoise(pixels, size, state);
+                break;
+            case Pattern::GRADIENT:
+                fillGradient(pixels, width, height, image, state);
+                break;
+            case Pattern::SOLID: {
+                const uint64_t colour = nextRandom(state);
+
+                for (uint64_t i = 0; i < size; i++) {
+                    pixels[i] = (uint8_t) (colour >> (i % 3 * 8));
+                }
+                break;
+            }
+        }
+    }
+
+    namespace {
+        // Where generated bytes go. Headers arrive in small pieces, pixels in one piece per image.
+        class Sink {
+        public:
+            virtual ~Sink() = default;
+            virtual bool put(const void *data, uint64_t size) = 0;
+        };
+
+        class MemorySink : public Sink {
+        public:
+            explicit MemorySink(std::vector<char> &out) : out(out) {}
+
+            bool put(const void *data, uint64_t size) override {
+                const char *bytes = static_cast<const char *>(data);
+                out.insert(out.end(), bytes, bytes + size);
+                return true;
+            }
+
+        private:
+            std::vector<char> &out;
+        };
+
+        // Collects headers into one buffer and hands pixels straight to write(), so a file is written in a few
+        // large calls with no extra copy of the pixels.
+        class FileSink : public Sink {
+        public:
+            explicit FileSink(int fd) : fd(fd) {}
+
+            bool put(const void *data, uint64_t size) override {
+                if (size < smallWrite) {
+                    const char *bytes = static_cast<const char *>(data);
+                    pending.insert(pending.end(), bytes, bytes + size);
+                    return pending.size() < smallWrite || flush();
+                }
+
+                return flush() && writeAll(data, size);
+            }
+
+            bool flush() {
+                bool success = writeAll(pending.data(), pending.size());
+                pending.clear();
+                return success;
+            }
+
+        private:
+            static const uint64_t smallWrite = 64 << 10;
+
+            bool writeAll(const void *data, uint64_t size) {
+                const char *bytes = static_cast<const char *>(data);
+
+                while (size > 0) {
+                    ssize_t written = write(fd, bytes, size);
+
+                    if (written < 0 && errno == EINTR) {
+                        continue;
+                    }
+
+                    if (written <= 0) {
+                        return false;
+                    }
+
+                    bytes += written;
+                    size -= (uint64_t) written;
+                }
+
+                return true;
+            }
+
+            int fd;
+            std::vector<char> pending;
+        };
+    }
+
+    static void append8(std::vector<char> &out, uint8_t value) {
+        out.push_back((char) value);
+    }
+
+    // All integers are little-endian, whatever the host.
+    static void append64(std::vector<char> &out, uint64_t value) {
+        for (int i = 0; i < 8; i++, value >>= 8) {
+            append8(out, (uint8_t) value);
+        }
+    }
+
+    static void appendCiffHeader(std::vector<char> &out, const Options &options) {
+        out.insert(out.end(), {'C', 'I', 'F', 'F'});
+        append64(out, ciffHeaderSize(options));
+        append64(out, options.width * options.height * 3);
+        append64(out, options.width);
+        append64(out, options.height);
+        out.insert(out.end(), options.caption.begin(), options.caption.end());
+        out.push_back('\n');
+
+        for (const std::string &tag : options.tags) {
+            out.insert(out.end(), tag.begin(), tag.end());
+            out.push_back('\0');
+        }
+    }
+
+    static bool generateCiff(const Options &options, Sink &sink) {
+        if (!validOptions(options)) {
+            return false;
+        }
+
+        std::vector<char> header;
+        std::vector<uint8_t> pixels(options.width * options.height * 3);
+
+        appendCiffHeader(header, options);
+        fillPixels(pixels.data(), options.width, options.height, options.pattern, options.seed, 0);
+        return sink.put(header.data(), header.size()) && sink.put(pixels.data(), pixels.size());
+    }
+
+    static bool generateCaff(const Options &options, Sink &sink) {
+        uint64_t ciff;
+        uint64_t caff;
+
+        if (!validOptions(options) || !sizesOf(options, ciff, caff)) {
+            return false;
+        }
+
+        std::vector<char> header;
+        static const char creator[] = "CAFF generator ";
+
+        append8(header, 0x1);
+        append64(header, caffHeaderSize);
+        header.insert(header.end(), {'C', 'A', 'F', 'F'});
+        append64(header, caffHeaderSize);
+        append64(header, options.frames);
+
+        append8(header, 0x2);
+        append64(header, creditsFixedSize + options.creatorLength);
+        header.insert(header.end(), {(char) 0xE8, 0x07, 1, 1, 12, 0});
+        append64(header, options.creatorLength);
+
+        if (!sink.put(header.data(), header.size())) {
+            return false;
+        }
+
+        // Creators of any length, without holding them in memory whole.
+        for (uint64_t written = 0; written < options.creatorLength;) {
+            const uint64_t piece = std::min<uint64_t>(options.creatorLength - written, sizeof(creator) - 1);
+
+            if (!sink.put(creator, piece)) {
+                return false;
+            }
+
+            written += piece;
+        }
+
+        std::vector<char> frameHeader;
+        append8(frameHeader, 0x3);
+        append64(frameHeader, sizeof(options.duration) + ciff);
+        append64(frameHeader, options.duration);
+        appendCiffHeader(frameHeader, options);
+
+        const uint64_t imageSize = options.width * options.height * 3;
+        const uint64_t distinct = options.distinctFrames == 0 ? options.frames : std::min(options.distinctFrames, options.frames);
+        const bool cacheAll = distinct < options.frames && distinct <= repeatCacheBytes / imageSize;
+        std::map<uint64_t, std::vector<uint8_t>> cached;
+        std::vector<uint8_t> pixels;
+        uint64_t pixelsImage = UINT64_MAX;
+
+        for (uint64_t frame = 0; frame < options.frames; frame++) {
+            const uint64_t image = frame % distinct;
+            const std::vector<uint8_t> *current = &pixels;
+
+            if (cacheAll && cached.count(image) != 0) {
+                current = &cached[image];
+            } else if (image != pixelsImage) {
+                pixels.resize(imageSize);
+                fillPixels(pixels.data(), options.width, options.height, options.pattern, options.seed, image);
+                pixelsImage = image;
+
+                if (cacheAll) {
+                    cached[image] = pixels;
+                }
+            }
+
+            if (!sink.put(frameHeader.data(), frameHeader.size()) || !sink.put(current->data(), current->size())) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool makeCiff(const Options &options, std::vector<char> &ciff) {
+        ciff.clear();
+        ciff.reserve(ciffSize(options));
+        MemorySink sink(ciff);
+        return generateCiff(options, sink);
+    }
+
+    bool makeCaff(const Options &options, std::vector<char> &caff) {
+        caff.clear();
+        caff.reserve(caffSize(options));
+        MemorySink sink(caff);
+        return generateCaff(options, sink);
+    }
+
+    // Runs generate into a new file at filePath, which is removed again if anything fails.
+    template<typename Generate>
+    static bool writeFile(const std::string &filePath, const Options &options, Generate generate) {
+        if (!validOptions(options)) {
+            return false;
+        }
+
+        int fd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        FileSink sink(fd);
+        bool success = generate(options, sink) && sink.flush();
+        success = close(fd) == 0 && success;
+
+        if (!success) {
+            unlink(filePath.c_str());
+        }
+
+        return success;
+    }
+
+    bool writeCiffFile(const std::string &filePath, const Options &options) {
+        return writeFile(filePath, options, generateCiff);
+    }
+
+    bool writeCaffFile(const std::string &filePath, const Options &options) {
+        return writeFile(filePath, options, generateCaff);
+    }
+}
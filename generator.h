@@ -0,0 +1,58 @@
+#ifndef PARSER_GENERATOR_H
+#define PARSER_GENERATOR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace generator {
+    // What the pixels of a generated image look like. NOISE is incompressible and keeps the entropy coder busy,
+    // GRADIENT is smooth with a little grain like a photo, and SOLID is a single colour that encodes to almost nothing.
+    enum class Pattern : uint8_t {
+        NOISE,
+        GRADIENT,
+        SOLID
+    };
+
+    // Shape of a generated CAFF or CIFF. A CIFF uses the size, pattern, caption, tags and seed only.
+    struct Options {
+        uint64_t width = 64;
+        uint64_t height = 64;
+        uint64_t frames = 1;
+        // Frames cycle through this many distinct images, so every later frame repeats an earlier one. 0 makes all
+        // frames distinct.
+        uint64_t distinctFrames = 0;
+        uint64_t duration = 100;
+        uint64_t creatorLength = 16;
+        Pattern pattern = Pattern::GRADIENT;
+        std::string caption = "Synthetic image";
+        std::vector<std::string> tags = {"synthetic"};
+        uint64_t seed = 1;
+    };
+
+    // Whether the options describe a document the parser accepts: non-zero sides, at least one frame, and sizes
+    // that do not overflow. Tags must not contain '\0', nor the caption '\n'.
+    bool validOptions(const Options &options);
+
+    // Fills width * height * 3 bytes with image number image of the pattern. Different images or seeds give
+    // different pixels; the same ones always give the same pixels.
+    void fillPixels(uint8_t *pixels, uint64_t width, uint64_t height, Pattern pattern, uint64_t seed, uint64_t image);
+
+    // Exact size of the generated document, for preallocation or to plan corpora.
+    uint64_t ciffSize(const Options &options);
+
+    uint64_t caffSize(const Options &options);
+
+    // Generate a whole document in memory. Return false if the options are not valid.
+    bool makeCiff(const Options &options, std::vector<char> &ciff);
+
+    bool makeCaff(const Options &options, std::vector<char> &caff);
+
+    // Write the document to a file, streaming one frame at a time: memory use is bounded by a few frames whatever
+    // the file size, and repeated frames are written from the pixels already generated.
+    bool writeCiffFile(const std::string &filePath, const Options &options);
+
+    bool writeCaffFile(const std::string &filePath, const Options &options);
+}
+
+#endif //PARSER_GENERATOR_H
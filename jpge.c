@@ -9,21 +9,61 @@
 //                       Code review revealed method load_block_16_8_8() (used for the non-default H2V1 sampling mode to downsample chroma) somehow didn't get the rounding factor fix from v1.02.
 
 #include "jpge.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define JPGE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define JPGE_X86_SIMD 0
+#endif
+
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
 #define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
 
 namespace jpge {
 
-static inline void *jpge_malloc(size_t nSize) { return malloc(nSize); }
-static inline void jpge_free(void *p) { free(p); }
+static void *default_malloc(size_t nSize, void *) { return malloc(nSize); }
+static void *default_realloc(void *p, size_t nSize, void *) { return realloc(p, nSize); }
+static void default_free(void *p, void *) { free(p); }
+
+static const allocator s_default_allocator = { default_malloc, default_realloc, default_free, NULL };
+static allocator s_allocator = s_default_allocator;
+
+void set_allocator(const allocator *pAllocator) { s_allocator = pAllocator ? *pAllocator : s_default_allocator; }
+
+static inline bool same_allocator(const allocator &a, const allocator &b)
+{
+  return (a.m_malloc == b.m_malloc) && (a.m_realloc == b.m_realloc) && (a.m_free == b.m_free) && (a.m_pUser == b.m_pUser);
+}
+
+static inline void *jpge_malloc(const allocator &a, size_t nSize) { return a.m_malloc(nSize, a.m_pUser); }
+static inline void jpge_free(const allocator &a, void *p) { if (p) a.m_free(p, a.m_pUser); }
+
+// Grows a buffer of old_size bytes to nSize bytes, keeping its contents.
+static inline void *jpge_realloc(const allocator &a, void *p, size_t old_size, size_t nSize)
+{
+  if (a.m_realloc)
+    return a.m_realloc(p, nSize, a.m_pUser);
+  void *pNew = a.m_malloc(nSize, a.m_pUser);
+  if ((pNew) && (p))
+  {
+    memcpy(pNew, p, JPGE_MIN(old_size, nSize));
+    a.m_free(p, a.m_pUser);
+  }
+  return pNew;
+}
 
 // Various JPEG enums and tables.
-enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
 enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
 static uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
@@ -60,7 +100,7 @@ template <class T> inline void clear_obj(T &obj) { memset(&obj, 0, sizeof(obj));
 const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
 static inline uint8 clamp(int i) { if (static_cast<uint>(i) > 255U) { if (i < 0) i = 0; else if (i > 255) i = 255; } return static_cast<uint8>(i); }
 
-static void RGB_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels)
+static void RGB_to_YCC_scalar(uint8* pDst, const uint8 *pSrc, int num_pixels)
 {
   for ( ; num_pixels; pDst += 3, pSrc += 3, num_pixels--)
   {
@@ -71,13 +111,13 @@ static void RGB_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels)
   }
 }
 
-static void RGB_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels)
+static void RGB_to_Y_scalar(uint8* pDst, const uint8 *pSrc, int num_pixels)
 {
   for ( ; num_pixels; pDst++, pSrc += 3, num_pixels--)
     pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
 }
 
-static void RGBA_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels)
+static void RGBA_to_YCC_scalar(uint8* pDst, const uint8 *pSrc, int num_pixels)
 {
   for ( ; num_pixels; pDst += 3, pSrc += 4, num_pixels--)
   {
@@ -88,17 +128,93 @@ static void RGBA_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels)
   }
 }
 
-static void RGBA_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels)
+static void RGBA_to_Y_scalar(uint8* pDst, const uint8 *pSrc, int num_pixels)
 {
   for ( ; num_pixels; pDst++, pSrc += 4, num_pixels--)
     pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
 }
 
-static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels)
+// Adds num_bytes source bytes to 16-bit column sums, for reduced size encoding.
+static void add_row_scalar(uint16 *pSums, const uint8 *pSrc, int num_bytes)
 {
-  for( ; num_pixels; pDst += 3, pSrc++, num_pixels--) { pDst[0] = pSrc[0]; pDst[1] = 128; pDst[2] = 128; }
+  for (int i = 0; i < num_bytes; i++)
+    pSums[i] = static_cast<uint16>(pSums[i] + pSrc[i]);
+}
+
+#if JPGE_X86_SIMD
+// AVX2 kernels: 8 pixels per iteration with the same 32-bit fixed point arithmetic as the scalar code, so the output is
+// bit identical. Saturating packs do the clamping. The remaining pixels go through the scalar code.
+template <int bpp>
+__attribute__((target("avx2"))) static inline void load_rgb_8_avx2(const uint8 *pSrc, __m256i &r, __m256i &g, __m256i &b)
+{
+  const __m128i deinterleave = (bpp == 3) ? _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1) : _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, -1, -1, -1, -1);
+  const __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc)), deinterleave);
+  const __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + 4 * bpp)), deinterleave);
+  const __m128i rg = _mm_unpacklo_epi32(p0, p1), bx = _mm_unpackhi_epi32(p0, p1);
+  r = _mm256_cvtepu8_epi32(rg);
+  g = _mm256_cvtepu8_epi32(_mm_srli_si128(rg, 8));
+  b = _mm256_cvtepu8_epi32(bx);
+}
+
+__attribute__((target("avx2"))) static inline __m128i weighted_sum_8_avx2(__m256i r, __m256i g, __m256i b, int cr, int cg, int cb, int bias)
+{
+  __m256i v = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(cr)), _mm256_mullo_epi32(g, _mm256_set1_epi32(cg)));
+  v = _mm256_add_epi32(v, _mm256_mullo_epi32(b, _mm256_set1_epi32(cb)));
+  v = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(32768)), 16), _mm256_set1_epi32(bias));
+  return _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+template <int bpp>
+__attribute__((target("avx2"))) static void to_YCC_avx2(uint8* pDst, const uint8 *pSrc, int num_pixels)
+{
+  const __m128i y_cb_lo = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5), cr_lo = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i y_cb_hi = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1), cr_hi = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+  // The second 16 byte load starts at pixel 4, so 3 byte pixels need a little slack past the 8th pixel.
+  for ( ; num_pixels >= ((bpp == 3) ? 10 : 8); pDst += 24, pSrc += 8 * bpp, num_pixels -= 8)
+  {
+    __m256i r, g, b;
+    load_rgb_8_avx2<bpp>(pSrc, r, g, b);
+    const __m128i y = weighted_sum_8_avx2(r, g, b, YR, YG, YB, 0);
+    const __m128i cb = weighted_sum_8_avx2(r, g, b, CB_R, CB_G, CB_B, 128);
+    const __m128i cr = weighted_sum_8_avx2(r, g, b, CR_R, CR_G, CR_B, 128);
+    const __m128i y_cb = _mm_packus_epi16(y, cb), cr8 = _mm_packus_epi16(cr, cr);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst), _mm_or_si128(_mm_shuffle_epi8(y_cb, y_cb_lo), _mm_shuffle_epi8(cr8, cr_lo)));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pDst + 16), _mm_or_si128(_mm_shuffle_epi8(y_cb, y_cb_hi), _mm_shuffle_epi8(cr8, cr_hi)));
+  }
+  if (bpp == 3)
+    RGB_to_YCC_scalar(pDst, pSrc, num_pixels);
+  else
+    RGBA_to_YCC_scalar(pDst, pSrc, num_pixels);
+}
+
+template <int bpp>
+__attribute__((target("avx2"))) static void to_Y_avx2(uint8* pDst, const uint8 *pSrc, int num_pixels)
+{
+  for ( ; num_pixels >= ((bpp == 3) ? 10 : 8); pDst += 8, pSrc += 8 * bpp, num_pixels -= 8)
+  {
+    __m256i r, g, b;
+    load_rgb_8_avx2<bpp>(pSrc, r, g, b);
+    const __m128i y = weighted_sum_8_avx2(r, g, b, YR, YG, YB, 0);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(pDst), _mm_packus_epi16(y, y));
+  }
+  if (bpp == 3)
+    RGB_to_Y_scalar(pDst, pSrc, num_pixels);
+  else
+    RGBA_to_Y_scalar(pDst, pSrc, num_pixels);
 }
 
+__attribute__((target("avx2"))) static void add_row_avx2(uint16 *pSums, const uint8 *pSrc, int num_bytes)
+{
+  int i = 0;
+  for ( ; i + 16 <= num_bytes; i += 16)
+  {
+    __m256i *pDst = reinterpret_cast<__m256i*>(pSums + i);
+    _mm256_storeu_si256(pDst, _mm256_add_epi16(_mm256_loadu_si256(pDst), _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i)))));
+  }
+  add_row_scalar(pSums + i, pSrc + i, num_bytes - i);
+}
+#endif
+
 // Forward DCT - DCT derived from jfdctint.
 enum { CONST_BITS = 13, ROW_BITS = 2 };
 #define DCT_DESCALE(x, n) (((x) + (((int32)1) << ((n) - 1))) >> (n))
@@ -138,6 +254,160 @@ static void DCT2D(int32 *p)
   }
 }
 
+// Quantizes the natural order DCT output into zigzag ordered coefficients. pQ holds the quantization table in natural order.
+static void quantize_scalar(int16 *pDst, const int32 *pSamples, const int32 *pQ, const int32 *)
+{
+  for (int i = 0; i < 64; i++)
+  {
+    int32 j = pSamples[s_zag[i]], q = pQ[s_zag[i]];
+    if (j < 0)
+    {
+      if ((j = -j + (q >> 1)) < q)
+        pDst[i] = 0;
+      else
+        pDst[i] = static_cast<int16>(-(j / q));
+    }
+    else
+    {
+      if ((j = j + (q >> 1)) < q)
+        pDst[i] = 0;
+      else
+        pDst[i] = static_cast<int16>(j / q);
+    }
+  }
+}
+
+#if JPGE_X86_SIMD
+// AVX2 DCT: the same integer arithmetic as DCT2D(), run on 8 rows or columns at once. The block is transposed so each
+// vector holds one sample position of all 8 rows. DCT_MUL truncates to int16, so a 16-bit multiply-add against
+// (c, 0) pairs gives exactly static_cast<int16>(v) * c.
+__attribute__((target("avx2"))) static inline __m256i dct_mul_avx2(__m256i v, int32 c)
+{
+  return _mm256_madd_epi16(v, _mm256_set1_epi32(c & 0xFFFF));
+}
+
+__attribute__((target("avx2"))) static inline __m256i dct_descale_avx2(__m256i v, int n)
+{
+  return _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(1 << (n - 1))), n);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void dct1d_avx2(__m256i *s)
+{
+  __m256i t0 = _mm256_add_epi32(s[0], s[7]), t7 = _mm256_sub_epi32(s[0], s[7]), t1 = _mm256_add_epi32(s[1], s[6]), t6 = _mm256_sub_epi32(s[1], s[6]);
+  __m256i t2 = _mm256_add_epi32(s[2], s[5]), t5 = _mm256_sub_epi32(s[2], s[5]), t3 = _mm256_add_epi32(s[3], s[4]), t4 = _mm256_sub_epi32(s[3], s[4]);
+  __m256i t10 = _mm256_add_epi32(t0, t3), t13 = _mm256_sub_epi32(t0, t3), t11 = _mm256_add_epi32(t1, t2), t12 = _mm256_sub_epi32(t1, t2);
+  __m256i u1 = dct_mul_avx2(_mm256_add_epi32(t12, t13), 4433);
+  s[2] = _mm256_add_epi32(u1, dct_mul_avx2(t13, 6270));
+  s[6] = _mm256_add_epi32(u1, dct_mul_avx2(t12, -15137));
+  u1 = _mm256_add_epi32(t4, t7);
+  __m256i u2 = _mm256_add_epi32(t5, t6), u3 = _mm256_add_epi32(t4, t6), u4 = _mm256_add_epi32(t5, t7);
+  __m256i z5 = dct_mul_avx2(_mm256_add_epi32(u3, u4), 9633);
+  t4 = dct_mul_avx2(t4, 2446); t5 = dct_mul_avx2(t5, 16819);
+  t6 = dct_mul_avx2(t6, 25172); t7 = dct_mul_avx2(t7, 12299);
+  u1 = dct_mul_avx2(u1, -7373); u2 = dct_mul_avx2(u2, -20995);
+  u3 = _mm256_add_epi32(dct_mul_avx2(u3, -16069), z5); u4 = _mm256_add_epi32(dct_mul_avx2(u4, -3196), z5);
+  s[0] = _mm256_add_epi32(t10, t11); s[4] = _mm256_sub_epi32(t10, t11);
+  s[1] = _mm256_add_epi32(_mm256_add_epi32(t7, u1), u4); s[3] = _mm256_add_epi32(_mm256_add_epi32(t6, u2), u3);
+  s[5] = _mm256_add_epi32(_mm256_add_epi32(t5, u2), u4); s[7] = _mm256_add_epi32(_mm256_add_epi32(t4, u1), u3);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void transpose_8x8_avx2(__m256i *v)
+{
+  const __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]), t1 = _mm256_unpackhi_epi32(v[0], v[1]), t2 = _mm256_unpacklo_epi32(v[2], v[3]), t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+  const __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]), t5 = _mm256_unpackhi_epi32(v[4], v[5]), t6 = _mm256_unpacklo_epi32(v[6], v[7]), t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+  const __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2), u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+  const __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6), u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+  v[0] = _mm256_permute2x128_si256(u0, u4, 0x20); v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  v[2] = _mm256_permute2x128_si256(u2, u6, 0x20); v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  v[4] = _mm256_permute2x128_si256(u0, u4, 0x31); v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  v[6] = _mm256_permute2x128_si256(u2, u6, 0x31); v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2"))) static void DCT2D_avx2(int32 *p)
+{
+  __m256i v[8];
+  for (int i = 0; i < 8; i++)
+    v[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i * 8));
+  transpose_8x8_avx2(v);
+  dct1d_avx2(v);
+  v[0] = _mm256_slli_epi32(v[0], ROW_BITS); v[4] = _mm256_slli_epi32(v[4], ROW_BITS);
+  v[1] = dct_descale_avx2(v[1], CONST_BITS-ROW_BITS); v[2] = dct_descale_avx2(v[2], CONST_BITS-ROW_BITS); v[3] = dct_descale_avx2(v[3], CONST_BITS-ROW_BITS);
+  v[5] = dct_descale_avx2(v[5], CONST_BITS-ROW_BITS); v[6] = dct_descale_avx2(v[6], CONST_BITS-ROW_BITS); v[7] = dct_descale_avx2(v[7], CONST_BITS-ROW_BITS);
+  transpose_8x8_avx2(v);
+  dct1d_avx2(v);
+  v[0] = dct_descale_avx2(v[0], ROW_BITS+3); v[4] = dct_descale_avx2(v[4], ROW_BITS+3);
+  v[1] = dct_descale_avx2(v[1], CONST_BITS+ROW_BITS+3); v[2] = dct_descale_avx2(v[2], CONST_BITS+ROW_BITS+3); v[3] = dct_descale_avx2(v[3], CONST_BITS+ROW_BITS+3);
+  v[5] = dct_descale_avx2(v[5], CONST_BITS+ROW_BITS+3); v[6] = dct_descale_avx2(v[6], CONST_BITS+ROW_BITS+3); v[7] = dct_descale_avx2(v[7], CONST_BITS+ROW_BITS+3);
+  for (int i = 0; i < 8; i++)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i * 8), v[i]);
+}
+
+// Divides by multiplying with pRecip[i] = 65536 / q and then fixes up the quotient, which can be one too small. Both
+// the rounding and the result match quantize_scalar() for any |sample| below 32768.
+__attribute__((target("avx2"))) static void quantize_avx2(int16 *pDst, const int32 *pSamples, const int32 *pQ, const int32 *pRecip)
+{
+  int32 quotients[64];
+  const __m256i all_ones = _mm256_set1_epi32(-1);
+  for (int i = 0; i < 64; i += 8)
+  {
+    const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSamples + i));
+    const __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pQ + i));
+    const __m256i n = _mm256_add_epi32(_mm256_abs_epi32(s), _mm256_srli_epi32(q, 1));
+    __m256i t = _mm256_srli_epi32(_mm256_mullo_epi32(n, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pRecip + i))), 16);
+    const __m256i too_big = _mm256_cmpgt_epi32(_mm256_mullo_epi32(_mm256_add_epi32(t, _mm256_set1_epi32(1)), q), n);
+    t = _mm256_sub_epi32(t, _mm256_xor_si256(too_big, all_ones));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(quotients + i), _mm256_sign_epi32(t, s));
+  }
+  for (int i = 0; i < 64; i++)
+    pDst[i] = static_cast<int16>(quotients[s_zag[i]]);
+}
+#endif
+
+// Colour conversion, row summing, DCT and quantization kernels, picked once for the running CPU.
+struct simd_kernels
+{
+  void (*m_RGB_to_YCC)(uint8* pDst, const uint8 *pSrc, int num_pixels);
+  void (*m_RGB_to_Y)(uint8* pDst, const uint8 *pSrc, int num_pixels);
+  void (*m_RGBA_to_YCC)(uint8* pDst, const uint8 *pSrc, int num_pixels);
+  void (*m_RGBA_to_Y)(uint8* pDst, const uint8 *pSrc, int num_pixels);
+  void (*m_add_row)(uint16 *pSums, const uint8 *pSrc, int num_bytes);
+  void (*m_DCT2D)(int32 *p);
+  void (*m_quantize)(int16 *pDst, const int32 *pSamples, const int32 *pQ, const int32 *pRecip);
+};
+
+static simd_kernels select_simd_kernels()
+{
+  simd_kernels k = { RGB_to_YCC_scalar, RGB_to_Y_scalar, RGBA_to_YCC_scalar, RGBA_to_Y_scalar, add_row_scalar, DCT2D, quantize_scalar };
+#if JPGE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    k.m_RGB_to_YCC = to_YCC_avx2<3>; k.m_RGB_to_Y = to_Y_avx2<3>;
+    k.m_RGBA_to_YCC = to_YCC_avx2<4>; k.m_RGBA_to_Y = to_Y_avx2<4>;
+    k.m_add_row = add_row_avx2;
+    k.m_DCT2D = DCT2D_avx2; k.m_quantize = quantize_avx2;
+  }
+#endif
+  return k;
+}
+
+static const simd_kernels &get_simd_kernels()
+{
+  static const simd_kernels s_kernels = select_simd_kernels();
+  return s_kernels;
+}
+
+static void RGB_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) { get_simd_kernels().m_RGB_to_YCC(pDst, pSrc, num_pixels); }
+static void RGB_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) { get_simd_kernels().m_RGB_to_Y(pDst, pSrc, num_pixels); }
+static void RGBA_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) { get_simd_kernels().m_RGBA_to_YCC(pDst, pSrc, num_pixels); }
+static void RGBA_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) { get_simd_kernels().m_RGBA_to_Y(pDst, pSrc, num_pixels); }
+static void add_row(uint16 *pSums, const uint8 *pSrc, int num_bytes) { get_simd_kernels().m_add_row(pSums, pSrc, num_bytes); }
+
+static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels)
+{
+  for( ; num_pixels; pDst += 3, pSrc++, num_pixels--) { pDst[0] = pSrc[0]; pDst[1] = 128; pDst[2] = 128; }
+}
+
 struct sym_freq { uint m_key, m_sym_index; };
 
 // Radix sorts sym_freq[] array by 32-bit key m_key. Returns ptr to sorted values.
@@ -243,6 +513,7 @@ void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
 // JPEG marker generation.
 void jpeg_encoder::emit_byte(uint8 i)
 {
+  STATS_COUNT(OUTPUT_BYTES, 1);
   m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_obj(i);
 }
 
@@ -352,6 +623,14 @@ void jpeg_encoder::emit_sos()
   emit_byte(0);
 }
 
+// Emit restart interval
+void jpeg_encoder::emit_dri()
+{
+  emit_marker(M_DRI);
+  emit_word(4);
+  emit_word(m_params.m_restart_interval);
+}
+
 // Emit all markers at beginning of image file.
 void jpeg_encoder::emit_markers()
 {
@@ -360,6 +639,8 @@ void jpeg_encoder::emit_markers()
   emit_dqt();
   emit_sof();
   emit_dhts();
+  if (m_params.m_restart_interval)
+    emit_dri();
   emit_sos();
 }
 
@@ -418,20 +699,26 @@ void jpeg_encoder::first_pass_init()
   m_bit_buffer = 0; m_bits_in = 0;
   memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
   m_mcu_y_ofs = 0;
+  m_mcus_coded = 0;
   m_pass_num = 1;
 }
 
 bool jpeg_encoder::second_pass_init()
 {
-  compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
-  compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
-  if (m_num_components > 1)
+  if (!m_std_huff_tables)
   {
-    compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
-    compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+    compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
+    compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
+    if (m_num_components > 1)
+    {
+      compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
+      compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+    }
   }
   first_pass_init();
-  emit_markers();
+  if (!m_segment_only)
+    emit_markers();
+  reserve_output_buffer();
   m_pass_num = 2;
   return true;
 }
@@ -473,36 +760,98 @@ bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
     }
   }
 
-  m_image_x        = p_x_res; m_image_y = p_y_res;
+  m_reduce_shift   = (m_params.m_reduction >= 8) ? 3 : ((m_params.m_reduction >= 4) ? 2 : ((m_params.m_reduction >= 2) ? 1 : 0));
+  m_src_x          = p_x_res; m_src_y = p_y_res;
+  m_image_x        = (p_x_res + (1 << m_reduce_shift) - 1) >> m_reduce_shift;
+  m_image_y        = (p_y_res + (1 << m_reduce_shift) - 1) >> m_reduce_shift;
   m_image_bpp      = src_channels;
-  m_image_bpl      = m_image_x * src_channels;
+  m_image_bpl      = m_src_x * src_channels;
   m_image_x_mcu    = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
   m_image_y_mcu    = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
   m_image_bpl_xlt  = m_image_x * m_num_components;
   m_image_bpl_mcu  = m_image_x_mcu * m_num_components;
   m_mcus_per_row   = m_image_x_mcu / m_mcu_x;
+  m_blocks_per_mcu = 0;
+  for (int c = 0; c < m_num_components; c++)
+  {
+    for (int i = m_comp_h_samp[c] * m_comp_v_samp[c]; i > 0; i--)
+      m_block_components[m_blocks_per_mcu++] = static_cast<uint8>(c);
+  }
 
-  if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) return false;
+  // Pick stripes of whole MCU rows, about two per thread so uneven stripes still balance out.
+  if ((m_params.m_max_threads > 1) && (!m_params.m_restart_interval) && (!m_params.m_two_pass_flag) && (!m_segment_only) && (m_mcus_per_row <= 0xFFFF))
+  {
+    int mcu_rows = m_image_y_mcu / m_mcu_y, stripes = m_params.m_max_threads * 2;
+    int rows_per_stripe = JPGE_MIN(JPGE_MAX((mcu_rows + stripes - 1) / stripes, 1), 0xFFFF / m_mcus_per_row);
+    m_params.m_restart_interval = static_cast<uint>(rows_per_stripe * m_mcus_per_row);
+  }
+
+  // The MCU lines, the internal output buffer if needed, the coefficients of one MCU row and the block sums of a reduced
+  // encode share one work buffer, which is kept between images and only reallocated when it is too small. The MCU lines
+  // and the output buffer both have even sizes, keeping the coefficients and the sums aligned.
+  m_out_buf_size = m_pUser_out_buf ? m_user_out_buf_size : JPGE_OUT_BUF_SIZE;
+  const size_t mcu_lines_size = static_cast<size_t>(m_image_bpl_mcu) * m_mcu_y + (m_pUser_out_buf ? 0 : m_out_buf_size);
+  const size_t row_coefs_size = static_cast<size_t>(m_mcus_per_row) * m_blocks_per_mcu * 64 * sizeof(int16);
+  const size_t reduce_size = m_reduce_shift ? static_cast<size_t>(m_image_bpl) * sizeof(uint16) + static_cast<size_t>(m_image_x) * m_image_bpp : 0;
+  const size_t work_size = mcu_lines_size + row_coefs_size + reduce_size;
+  if (work_size > m_work_buf_size)
+  {
+    jpge_free(m_allocator, m_pWork_buf);
+    m_work_buf_size = 0;
+    if ((m_pWork_buf = static_cast<uint8*>(jpge_malloc(m_allocator, work_size))) == NULL) return false;
+    m_work_buf_size = work_size;
+  }
+  m_mcu_lines[0] = m_pWork_buf;
   for (int i = 1; i < m_mcu_y; i++)
     m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
+  m_pOwn_out_buf = m_out_buf = m_pUser_out_buf ? m_pUser_out_buf : m_mcu_lines[0] + m_image_bpl_mcu * m_mcu_y;
+  m_own_out_buf_size = m_out_buf_size;
+  m_pRow_coefs = reinterpret_cast<int16*>(m_mcu_lines[0] + mcu_lines_size);
+  if (m_reduce_shift)
+  {
+    m_pReduce_sums = reinterpret_cast<uint16*>(m_mcu_lines[0] + mcu_lines_size + row_coefs_size);
+    m_pReduce_line = m_mcu_lines[0] + mcu_lines_size + row_coefs_size + static_cast<size_t>(m_image_bpl) * sizeof(uint16);
+  }
 
-  compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-  compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+  // Quantization tables only depend on the quality, and the standard Huffman codes on nothing, so both are kept from the
+  // previous image when possible.
+  if ((m_quant_quality != m_params.m_quality) || (m_quant_no_chroma_discrim != m_params.m_no_chroma_discrim_flag))
+  {
+    compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
+    compute_quant_table(m_quantization_tables[1], m_params.m_no_chroma_discrim_flag ? s_std_lum_quant : s_std_croma_quant);
+    for (int t = 0; t < 2; t++)
+    {
+      for (int i = 0; i < 64; i++)
+      {
+        m_quantization_natural[t][s_zag[i]] = m_quantization_tables[t][i];
+        m_quantization_recip[t][s_zag[i]] = 65536 / m_quantization_tables[t][i];
+      }
+    }
+    m_quant_quality = m_params.m_quality;
+    m_quant_no_chroma_discrim = m_params.m_no_chroma_discrim_flag;
+  }
 
-  m_out_buf_left = JPGE_OUT_BUF_SIZE;
+  m_out_buf_left = m_out_buf_size;
   m_pOut_buf = m_out_buf;
 
   if (m_params.m_two_pass_flag)
   {
+    m_std_huff_tables = false;
     clear_obj(m_huff_count);
     first_pass_init();
   }
   else
   {
-    memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val [0+0], s_dc_lum_val, DC_LUM_CODES);
-    memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val [2+0], s_ac_lum_val, AC_LUM_CODES);
-    memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val [0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-    memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val [2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+    if (!m_std_huff_tables)
+    {
+      memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val [0+0], s_dc_lum_val, DC_LUM_CODES);
+      memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val [2+0], s_ac_lum_val, AC_LUM_CODES);
+      memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val [0+1], s_dc_chroma_val, DC_CHROMA_CODES);
+      memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val [2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+      for (int i = 0; i < 4; i++)
+        compute_huffman_table(&m_huff_codes[i][0], &m_huff_code_sizes[i][0], m_huff_bits[i], m_huff_val[i]);
+      m_std_huff_tables = true;
+    }
     if (!second_pass_init()) return false;   // in effect, skip over the first pass
   }
   return m_all_stream_writes_succeeded;
@@ -568,58 +917,97 @@ void jpeg_encoder::load_block_16_8_8(int x, int c)
   }
 }
 
-void jpeg_encoder::load_quantized_coefficients(int component_num)
+// Runs the DCT on m_sample_array, stores the quantized coefficients in zigzag order at pDst and advances pDst past them.
+void jpeg_encoder::transform_block(int component_num, int16 *&pDst)
 {
-  int32 *q = m_quantization_tables[component_num > 0];
-  int16 *pDst = m_coefficient_array;
-  for (int i = 0; i < 64; i++)
-  {
-    sample_array_t j = m_sample_array[s_zag[i]];
-    if (j < 0)
-    {
-      if ((j = -j + (*q >> 1)) < *q)
-        *pDst++ = 0;
-      else
-        *pDst++ = static_cast<int16>(-(j / *q));
-    }
-    else
-    {
-      if ((j = j + (*q >> 1)) < *q)
-        *pDst++ = 0;
-      else
-        *pDst++ = static_cast<int16>((j / *q));
-    }
-    q++;
-  }
+  const simd_kernels &kernels = get_simd_kernels();
+  kernels.m_DCT2D(m_sample_array);
+  kernels.m_quantize(pDst, m_sample_array, m_quantization_natural[component_num > 0], m_quantization_recip[component_num > 0]);
+  pDst += 64;
 }
 
 void jpeg_encoder::flush_output_buffer()
 {
-  if (m_out_buf_left != JPGE_OUT_BUF_SIZE)
-    m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, JPGE_OUT_BUF_SIZE - m_out_buf_left);
+  // Stripe encoders only produce segments, which are counted when they are copied into the final stream.
+  if (!m_segment_only)
+    STATS_COUNT(OUTPUT_BYTES, m_out_buf_size - m_out_buf_left);
+  if (m_out_buf_left != m_out_buf_size)
+    m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, m_out_buf_size - m_out_buf_left);
+  reserve_output_buffer();
+}
+
+// Codes straight into the stream when it offers space, otherwise into the user's or the encoder's own buffer.
+void jpeg_encoder::reserve_output_buffer()
+{
+  uint size = 0;
+  uint8 *pBuf = m_pStream->reserve_buf(size);
+  const bool direct = (pBuf) && (size >= JPGE_MIN_OUT_BUF_SIZE);
+  m_out_buf = direct ? pBuf : m_pOwn_out_buf;
+  m_out_buf_size = direct ? size : m_own_out_buf_size;
   m_pOut_buf = m_out_buf;
-  m_out_buf_left = JPGE_OUT_BUF_SIZE;
+  m_out_buf_left = m_out_buf_size;
 }
 
+#define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
+
+// The low m_bits_in bits of m_bit_buffer are pending output, oldest first. Codes are at most 16 bits, so up to 47 bits
+// are held and whole 32-bit words go out in one go unless one of their bytes is 0xFF and needs a stuffed 0 after it.
 void jpeg_encoder::put_bits(uint bits, uint len)
 {
-  m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
+  m_bit_buffer = (m_bit_buffer << len) | bits;
+  if ((m_bits_in += len) >= 32)
+  {
+    const uint32 c = static_cast<uint32>(m_bit_buffer >> (m_bits_in - 32));
+    if ((((~c - 0x01010101U) & c & 0x80808080U) == 0) && (m_out_buf_left >= 4))
+    {
+      m_pOut_buf[0] = static_cast<uint8>(c >> 24); m_pOut_buf[1] = static_cast<uint8>(c >> 16);
+      m_pOut_buf[2] = static_cast<uint8>(c >> 8);  m_pOut_buf[3] = static_cast<uint8>(c);
+      m_pOut_buf += 4;
+      m_bits_in -= 32;
+      if ((m_out_buf_left -= 4) == 0) flush_output_buffer();
+    }
+    else
+      flush_bits();
+  }
+}
+
+// Writes out all whole bytes held in the bit buffer.
+void jpeg_encoder::flush_bits()
+{
   while (m_bits_in >= 8)
   {
-    uint8 c;
-    #define JPGE_PUT_BYTE(c) { *m_pOut_buf++ = (c); if (--m_out_buf_left == 0) flush_output_buffer(); }
-    JPGE_PUT_BYTE(c = (uint8)((m_bit_buffer >> 16) & 0xFF));
+    const uint8 c = static_cast<uint8>(m_bit_buffer >> (m_bits_in - 8));
+    JPGE_PUT_BYTE(c);
     if (c == 0xFF) JPGE_PUT_BYTE(0);
-    m_bit_buffer <<= 8;
     m_bits_in -= 8;
   }
 }
 
-void jpeg_encoder::code_coefficients_pass_one(int component_num)
+// Byte aligns the entropy coded data, emits the next RSTn marker and resets the DC predictors.
+void jpeg_encoder::emit_restart()
+{
+  if (m_pass_num == 2)
+  {
+    put_bits(0x7F, 7);
+    flush_bits();
+    m_bit_buffer = 0; m_bits_in = 0;
+    JPGE_PUT_BYTE(0xFF);
+    JPGE_PUT_BYTE(static_cast<uint8>(M_RST0 + ((m_mcus_coded / m_params.m_restart_interval - 1) & 7)));
+  }
+  memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+}
+
+void jpeg_encoder::begin_mcu()
+{
+  if ((m_params.m_restart_interval) && (m_mcus_coded) && ((m_mcus_coded % m_params.m_restart_interval) == 0))
+    emit_restart();
+  m_mcus_coded++;
+}
+
+void jpeg_encoder::code_coefficients_pass_one(int component_num, const int16 *src)
 {
   if (component_num >= 3) return; // just to shut up static analysis
   int i, run_len, nbits, temp1;
-  int16 *src = m_coefficient_array;
   uint32 *dc_count = component_num ? m_huff_count[0 + 1] : m_huff_count[0 + 0], *ac_count = component_num ? m_huff_count[2 + 1] : m_huff_count[2 + 0];
 
   temp1 = src[0] - m_last_dc_val[component_num];
@@ -635,7 +1023,7 @@ void jpeg_encoder::code_coefficients_pass_one(int component_num)
   dc_count[nbits]++;
   for (run_len = 0, i = 1; i < 64; i++)
   {
-    if ((temp1 = m_coefficient_array[i]) == 0)
+    if ((temp1 = src[i]) == 0)
       run_len++;
     else
     {
@@ -654,10 +1042,9 @@ void jpeg_encoder::code_coefficients_pass_one(int component_num)
   if (run_len) ac_count[0]++;
 }
 
-void jpeg_encoder::code_coefficients_pass_two(int component_num)
+void jpeg_encoder::code_coefficients_pass_two(int component_num, const int16 *pSrc)
 {
   int i, j, run_len, nbits, temp1, temp2;
-  int16 *pSrc = m_coefficient_array;
   uint *codes[2];
   uint8 *code_sizes[2];
 
@@ -691,7 +1078,7 @@ void jpeg_encoder::code_coefficients_pass_two(int component_num)
 
   for (run_len = 0, i = 1; i < 64; i++)
   {
-    if ((temp1 = m_coefficient_array[i]) == 0)
+    if ((temp1 = pSrc[i]) == 0)
       run_len++;
     else
     {
@@ -718,49 +1105,114 @@ void jpeg_encoder::code_coefficients_pass_two(int component_num)
     put_bits(codes[1][0], code_sizes[1][0]);
 }
 
-void jpeg_encoder::code_block(int component_num)
+// Entropy codes the quantized coefficients at pSrc, or in the first pass of two pass mode gathers their statistics and
+// buffers them for the second.
+void jpeg_encoder::code_block(int component_num, const int16 *pSrc)
 {
-  DCT2D(m_sample_array);
-  load_quantized_coefficients(component_num);
   if (m_pass_num == 1)
-    code_coefficients_pass_one(component_num);
+  {
+    code_coefficients_pass_one(component_num, pSrc);
+    buffer_block(pSrc);
+  }
   else
-    code_coefficients_pass_two(component_num);
+    code_coefficients_pass_two(component_num, pSrc);
 }
 
-void jpeg_encoder::process_mcu_row()
+// Appends the coefficients at pSrc to the block buffer as the DC value followed by (zigzag index, value) pairs for the
+// nonzero AC coefficients and a 0 index, which is usually a fraction of the 128 bytes of the whole block.
+void jpeg_encoder::buffer_block(const int16 *pSrc)
 {
-  if (m_num_components == 1)
+  enum { MAX_PACKED_BLOCK_SIZE = 2 + 63 * 3 + 1 };
+  if (m_block_buf_ofs + MAX_PACKED_BLOCK_SIZE > m_block_buf_size)
   {
-    for (int i = 0; i < m_mcus_per_row; i++)
-    {
-      load_block_8_8_grey(i); code_block(0);
-    }
+    size_t new_size = JPGE_MAX(m_block_buf_size * 2, static_cast<size_t>(64 * 1024));
+    uint8 *pNew_buf = static_cast<uint8*>(jpge_realloc(m_allocator, m_pBlock_buf, m_block_buf_size, new_size));
+    if (!pNew_buf) { m_all_stream_writes_succeeded = false; return; }
+    m_pBlock_buf = pNew_buf; m_block_buf_size = new_size;
   }
-  else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
+  uint8 *pDst = m_pBlock_buf + m_block_buf_ofs;
+  memcpy(pDst, &pSrc[0], 2); pDst += 2;
+  for (int i = 1; i < 64; i++)
   {
-    for (int i = 0; i < m_mcus_per_row; i++)
+    if (pSrc[i])
     {
-      load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
+      *pDst++ = static_cast<uint8>(i);
+      memcpy(pDst, &pSrc[i], 2); pDst += 2;
     }
   }
-  else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
+  *pDst++ = 0;
+  m_block_buf_ofs = pDst - m_pBlock_buf;
+}
+
+// Second pass of two pass mode: entropy codes the blocks buffered by the first pass, MCU by MCU.
+void jpeg_encoder::code_buffered_blocks()
+{
+  STATS_TIMER(ENTROPY_CODE);
+  const uint8 *pSrc = m_pBlock_buf, *pEnd = m_pBlock_buf + m_block_buf_ofs;
+  while (pSrc < pEnd)
   {
-    for (int i = 0; i < m_mcus_per_row; i++)
+    begin_mcu();
+    for (int b = 0; b < m_blocks_per_mcu; b++)
     {
-      load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-      load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
+      clear_obj(m_coefficient_array);
+      memcpy(&m_coefficient_array[0], pSrc, 2); pSrc += 2;
+      for (int i; (i = *pSrc++) != 0; pSrc += 2)
+        memcpy(&m_coefficient_array[i], pSrc, 2);
+      code_coefficients_pass_two(m_block_components[b], m_coefficient_array);
     }
   }
-  else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
+  m_block_buf_ofs = 0;
+}
+
+// Transforms the whole row into m_pRow_coefs first and codes it afterwards, so each phase is timed once per row rather
+// than once per block.
+void jpeg_encoder::process_mcu_row()
+{
+  STATS_COUNT(MCUS, static_cast<uint64>(m_mcus_per_row));
   {
-    for (int i = 0; i < m_mcus_per_row; i++)
+    STATS_TIMER(DCT);
+    int16 *pDst = m_pRow_coefs;
+    if (m_num_components == 1)
     {
-      load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-      load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
-      load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
+      for (int i = 0; i < m_mcus_per_row; i++)
+      {
+        load_block_8_8_grey(i); transform_block(0, pDst);
+      }
+    }
+    else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
+    {
+      for (int i = 0; i < m_mcus_per_row; i++)
+      {
+        load_block_8_8(i, 0, 0); transform_block(0, pDst); load_block_8_8(i, 0, 1); transform_block(1, pDst); load_block_8_8(i, 0, 2); transform_block(2, pDst);
+      }
+    }
+    else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
+    {
+      for (int i = 0; i < m_mcus_per_row; i++)
+      {
+        load_block_8_8(i * 2 + 0, 0, 0); transform_block(0, pDst); load_block_8_8(i * 2 + 1, 0, 0); transform_block(0, pDst);
+        load_block_16_8_8(i, 1); transform_block(1, pDst); load_block_16_8_8(i, 2); transform_block(2, pDst);
+      }
+    }
+    else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
+    {
+      for (int i = 0; i < m_mcus_per_row; i++)
+      {
+        load_block_8_8(i * 2 + 0, 0, 0); transform_block(0, pDst); load_block_8_8(i * 2 + 1, 0, 0); transform_block(0, pDst);
+        load_block_8_8(i * 2 + 0, 1, 0); transform_block(0, pDst); load_block_8_8(i * 2 + 1, 1, 0); transform_block(0, pDst);
+        load_block_16_8(i, 1); transform_block(1, pDst); load_block_16_8(i, 2); transform_block(2, pDst);
+      }
     }
   }
+
+  STATS_TIMER(ENTROPY_CODE);
+  const int16 *pSrc = m_pRow_coefs;
+  for (int i = 0; i < m_mcus_per_row; i++)
+  {
+    begin_mcu();
+    for (int b = 0; b < m_blocks_per_mcu; b++, pSrc += 64)
+      code_block(m_block_components[b], pSrc);
+  }
 }
 
 bool jpeg_encoder::terminate_pass_one()
@@ -776,8 +1228,10 @@ bool jpeg_encoder::terminate_pass_one()
 bool jpeg_encoder::terminate_pass_two()
 {
   put_bits(0x7F, 7);
+  flush_bits();
   flush_output_buffer();
-  emit_marker(M_EOI);
+  if (!m_segment_only)
+    emit_marker(M_EOI);
   m_pass_num++; // purposely bump up m_pass_num, for debugging
   return true;
 }
@@ -796,9 +1250,11 @@ bool jpeg_encoder::process_end_of_image()
   }
 
   if (m_pass_num == 1)
-    return terminate_pass_one();
-  else
-    return terminate_pass_two();
+  {
+    if ((!m_all_stream_writes_succeeded) || (!terminate_pass_one())) return false;
+    code_buffered_blocks();
+  }
+  return terminate_pass_two();
 }
 
 void jpeg_encoder::load_mcu(const void *pSrc)
@@ -807,23 +1263,26 @@ void jpeg_encoder::load_mcu(const void *pSrc)
 
   uint8* pDst = m_mcu_lines[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
 
-  if (m_num_components == 1)
   {
-    if (m_image_bpp == 4)
-      RGBA_to_Y(pDst, Psrc, m_image_x);
-    else if (m_image_bpp == 3)
-      RGB_to_Y(pDst, Psrc, m_image_x);
-    else
-      memcpy(pDst, Psrc, m_image_x);
-  }
-  else
-  {
-    if (m_image_bpp == 4)
-      RGBA_to_YCC(pDst, Psrc, m_image_x);
-    else if (m_image_bpp == 3)
-      RGB_to_YCC(pDst, Psrc, m_image_x);
+    STATS_TIMER(COLOR_CONVERT);
+    if (m_num_components == 1)
+    {
+      if (m_image_bpp == 4)
+        RGBA_to_Y(pDst, Psrc, m_image_x);
+      else if (m_image_bpp == 3)
+        RGB_to_Y(pDst, Psrc, m_image_x);
+      else
+        memcpy(pDst, Psrc, m_image_x);
+    }
     else
-      Y_to_YCC(pDst, Psrc, m_image_x);
+    {
+      if (m_image_bpp == 4)
+        RGBA_to_YCC(pDst, Psrc, m_image_x);
+      else if (m_image_bpp == 3)
+        RGB_to_YCC(pDst, Psrc, m_image_x);
+      else
+        Y_to_YCC(pDst, Psrc, m_image_x);
+    }
   }
 
   // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
@@ -846,14 +1305,61 @@ void jpeg_encoder::load_mcu(const void *pSrc)
   }
 }
 
+// Adds one source scanline to the column sums of the current row of blocks. Once the row is complete its block means go to
+// load_mcu() as one scanline of the reduced image.
+void jpeg_encoder::load_reduced_scanline(const uint8 *pSrc)
+{
+  if (!m_reduce_rows)
+    memset(m_pReduce_sums, 0, static_cast<size_t>(m_image_bpl) * sizeof(uint16));
+  add_row(m_pReduce_sums, pSrc, m_image_bpl);
+  if (++m_reduce_rows == (1 << m_reduce_shift))
+    flush_reduced_scanline();
+}
+
+// Sums the columns of each block and turns them into means. Called early for the last row of blocks if the image height is
+// not a multiple of the factor. Blocks on the right edge may be narrower than the others.
+void jpeg_encoder::flush_reduced_scanline()
+{
+  const int bpp = m_image_bpp, factor = 1 << m_reduce_shift, full_blocks = m_src_x >> m_reduce_shift;
+  const uint16 *pSums = m_pReduce_sums;
+  uint8 *pDst = m_pReduce_line;
+
+  for (int x = 0; x < m_image_x; x++, pDst += bpp)
+  {
+    const uint n = static_cast<uint>((x < full_blocks) ? factor : (m_src_x - (x << m_reduce_shift)));
+    const uint area = n * static_cast<uint>(m_reduce_rows);
+    for (int c = 0; c < bpp; c++)
+    {
+      uint sum = 0;
+      for (const uint16 *p = pSums + c, *pEnd = p + n * bpp; p < pEnd; p += bpp)
+        sum += *p;
+      pDst[c] = static_cast<uint8>((sum + area / 2) / area);
+    }
+    pSums += n * bpp;
+  }
+
+  m_reduce_rows = 0;
+  load_mcu(m_pReduce_line);
+}
+
 void jpeg_encoder::clear()
 {
   m_mcu_lines[0] = NULL;
   m_pass_num = 0;
   m_all_stream_writes_succeeded = true;
+  m_segment_only = false;
+  m_mcus_coded = 0;
+  m_block_buf_ofs = 0;
+  m_reduce_shift = m_reduce_rows = 0;
+  m_pReduce_sums = NULL;
+  m_pReduce_line = NULL;
+  m_pRow_coefs = NULL;
+  m_blocks_per_mcu = 0;
 }
 
-jpeg_encoder::jpeg_encoder()
+jpeg_encoder::jpeg_encoder() :
+  m_allocator(s_default_allocator), m_pUser_out_buf(NULL), m_user_out_buf_size(0), m_pOwn_out_buf(NULL), m_own_out_buf_size(0), m_pBlock_buf(NULL), m_block_buf_size(0), m_pWork_buf(NULL), m_work_buf_size(0),
+  m_quant_quality(0), m_quant_no_chroma_discrim(false), m_std_huff_tables(false)
 {
   clear();
 }
@@ -863,18 +1369,48 @@ jpeg_encoder::~jpeg_encoder()
   deinit();
 }
 
-bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
+bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params, const allocator *pAllocator)
 {
-  deinit();
+  return open(pStream, width, height, src_channels, comp_params, pAllocator, false);
+}
+
+// With segment_only set only the entropy coded data is written: no markers, and the last byte is padded but not followed by EOI.
+bool jpeg_encoder::open(output_stream *pStream, int width, int height, int src_channels, const params &comp_params, const allocator *pAllocator, bool segment_only)
+{
+  const allocator new_allocator = pAllocator ? *pAllocator : s_allocator;
+  if ((!new_allocator.m_malloc) || (!new_allocator.m_free)) return false;
+  if (!same_allocator(m_allocator, new_allocator))
+  {
+    deinit();
+    m_allocator = new_allocator;
+  }
+  reset();
   if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
   m_pStream = pStream;
   m_params = comp_params;
+  m_segment_only = segment_only;
   return jpg_open(width, height, src_channels);
 }
 
+bool jpeg_encoder::set_output_buffer(void *pBuf, uint buf_size)
+{
+  if ((pBuf) && (buf_size < JPGE_MIN_OUT_BUF_SIZE)) return false;
+  m_pUser_out_buf = static_cast<uint8*>(pBuf);
+  m_user_out_buf_size = pBuf ? buf_size : 0;
+  return true;
+}
+
 void jpeg_encoder::deinit()
 {
-  jpge_free(m_mcu_lines[0]);
+  jpge_free(m_allocator, m_pWork_buf);
+  jpge_free(m_allocator, m_pBlock_buf);
+  m_pWork_buf = NULL; m_pBlock_buf = NULL;
+  m_work_buf_size = m_block_buf_size = 0;
+  clear();
+}
+
+void jpeg_encoder::reset()
+{
   clear();
 }
 
@@ -885,8 +1421,14 @@ bool jpeg_encoder::process_scanline(const void* pScanline)
   {
     if (!pScanline)
     {
+      if (m_reduce_rows)
+        flush_reduced_scanline();
       if (!process_end_of_image()) return false;
     }
+    else if (m_reduce_shift)
+    {
+      load_reduced_scanline(static_cast<const uint8*>(pScanline));
+    }
     else
     {
       load_mcu(pScanline);
@@ -895,6 +1437,297 @@ bool jpeg_encoder::process_scanline(const void* pScanline)
   return m_all_stream_writes_succeeded;
 }
 
+// Growable memory stream holding the entropy coded data of one stripe.
+class segment_stream : public output_stream
+{
+  segment_stream(const segment_stream &);
+  segment_stream &operator= (const segment_stream &);
+
+  allocator m_allocator;
+  uint8 *m_pBuf;
+  size_t m_buf_size, m_buf_ofs;
+
+public:
+  segment_stream() : m_allocator(s_default_allocator), m_pBuf(NULL), m_buf_size(0), m_buf_ofs(0) { }
+
+  virtual ~segment_stream() { jpge_free(m_allocator, m_pBuf); }
+
+  void set_allocator(const allocator &a) { m_allocator = a; }
+
+  bool grow(size_t min_size)
+  {
+    size_t new_size = JPGE_MAX(m_buf_size * 2, min_size);
+    uint8 *pNew_buf = static_cast<uint8*>(jpge_realloc(m_allocator, m_pBuf, m_buf_size, new_size));
+    if (!pNew_buf) return false;
+    m_pBuf = pNew_buf; m_buf_size = new_size;
+    return true;
+  }
+
+  virtual bool put_buf(const void* pBuf, int len)
+  {
+    if (len < 0) return false;
+    // Coded in place into the space from reserve_buf().
+    if ((pBuf == m_pBuf + m_buf_ofs) && (m_buf_ofs + len <= m_buf_size))
+    {
+      m_buf_ofs += len;
+      return true;
+    }
+    if ((m_buf_ofs + len > m_buf_size) && (!grow(m_buf_ofs + len))) return false;
+    memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+    m_buf_ofs += len;
+    return true;
+  }
+
+  virtual uint8 *reserve_buf(uint &size)
+  {
+    enum { MIN_RESERVE = 4096, GROW_RESERVE = 64 * 1024 };
+    size = 0;
+    if ((m_buf_size - m_buf_ofs < MIN_RESERVE) && (!grow(m_buf_ofs + GROW_RESERVE))) return NULL;
+    size = static_cast<uint>(JPGE_MIN(m_buf_size - m_buf_ofs, static_cast<size_t>(1) << 30));
+    return m_pBuf + m_buf_ofs;
+  }
+
+  const uint8 *get_data() const { return m_pBuf; }
+  size_t get_size() const { return m_buf_ofs; }
+};
+
+chunk_stream::chunk_stream(uint chunk_size, const allocator *pAllocator) :
+  m_allocator(pAllocator ? *pAllocator : s_allocator), m_chunk_size(JPGE_MAX(chunk_size, 1024U)), m_pChunks(NULL), m_num_chunks(0), m_max_chunks(0), m_num_used(0), m_size(0)
+{
+}
+
+chunk_stream::~chunk_stream()
+{
+  for (uint i = 0; i < m_num_chunks; i++)
+    jpge_free(m_allocator, m_pChunks[i].m_pData);
+  jpge_free(m_allocator, m_pChunks);
+}
+
+void chunk_stream::clear()
+{
+  m_num_used = 0;
+  m_size = 0;
+}
+
+// Moves on to the next chunk, reusing one kept by clear() or allocating a new one sized to about the data so far, so the
+// number of chunks only grows logarithmically with the output size.
+bool chunk_stream::next_chunk()
+{
+  enum { MAX_CHUNK_SIZE = 16 * 1024 * 1024 };
+  if (m_num_used == m_num_chunks)
+  {
+    if (m_num_chunks == m_max_chunks)
+    {
+      const uint new_max = JPGE_MAX(m_max_chunks * 2, 8U);
+      chunk *pNew_chunks = static_cast<chunk*>(jpge_realloc(m_allocator, m_pChunks, m_max_chunks * sizeof(chunk), new_max * sizeof(chunk)));
+      if (!pNew_chunks) return false;
+      m_pChunks = pNew_chunks; m_max_chunks = new_max;
+    }
+    const uint capacity = static_cast<uint>(JPGE_MAX(static_cast<size_t>(m_chunk_size), JPGE_MIN(m_size, static_cast<size_t>(MAX_CHUNK_SIZE))));
+    uint8 *pData = static_cast<uint8*>(jpge_malloc(m_allocator, capacity));
+    if (!pData) return false;
+    m_pChunks[m_num_chunks].m_pData = pData;
+    m_pChunks[m_num_chunks].m_capacity = capacity;
+    m_num_chunks++;
+  }
+  m_pChunks[m_num_used++].m_used = 0;
+  return true;
+}
+
+bool chunk_stream::put_buf(const void* pBuf, int len)
+{
+  if (len < 0) return false;
+  const uint8 *pSrc = static_cast<const uint8*>(pBuf);
+  uint left = static_cast<uint>(len);
+  if (m_num_used)
+  {
+    // Coded in place into the space from reserve_buf().
+    chunk &cur = m_pChunks[m_num_used - 1];
+    if ((pSrc == cur.m_pData + cur.m_used) && (left <= cur.m_capacity - cur.m_used))
+    {
+      cur.m_used += left;
+      m_size += left;
+      return true;
+    }
+  }
+  while (left)
+  {
+    if (((!m_num_used) || (m_pChunks[m_num_used - 1].m_used == m_pChunks[m_num_used - 1].m_capacity)) && (!next_chunk()))
+      return false;
+    chunk &cur = m_pChunks[m_num_used - 1];
+    const uint n = JPGE_MIN(left, cur.m_capacity - cur.m_used);
+    memcpy(cur.m_pData + cur.m_used, pSrc, n);
+    cur.m_used += n;
+    m_size += n;
+    pSrc += n;
+    left -= n;
+  }
+  return true;
+}
+
+uint8 *chunk_stream::reserve_buf(uint &size)
+{
+  enum { MIN_RESERVE = 256 };
+  size = 0;
+  if (((!m_num_used) || (m_pChunks[m_num_used - 1].m_capacity - m_pChunks[m_num_used - 1].m_used < MIN_RESERVE)) && (!next_chunk()))
+    return NULL;
+  chunk &cur = m_pChunks[m_num_used - 1];
+  size = cur.m_capacity - cur.m_used;
+  return cur.m_pData + cur.m_used;
+}
+
+// Only the last chunk can be empty, when space was reserved in it but nothing written.
+uint chunk_stream::get_num_chunks() const
+{
+  return ((m_num_used) && (!m_pChunks[m_num_used - 1].m_used)) ? m_num_used - 1 : m_num_used;
+}
+
+const uint8 *chunk_stream::get_chunk(uint i, size_t &size) const
+{
+  size = (i < m_num_used) ? m_pChunks[i].m_used : 0;
+  return (i < m_num_used) ? m_pChunks[i].m_pData : NULL;
+}
+
+bool jpeg_encoder::process_image(const uint8 *pImage_data)
+{
+  if ((m_pass_num < 1) || (m_pass_num > 2)) return false;
+
+  const uint interval = m_params.m_restart_interval;
+  const int rows_per_stripe = ((interval) && ((interval % m_mcus_per_row) == 0)) ? static_cast<int>(interval / m_mcus_per_row) * m_mcu_y : 0;
+  const int num_stripes = rows_per_stripe ? (m_image_y + rows_per_stripe - 1) / rows_per_stripe : 0;
+
+  if ((m_params.m_max_threads > 1) && (m_pass_num == 2) && (num_stripes > 1) && (!m_segment_only) && (!m_mcus_coded) && (!m_mcu_y_ofs) && (!m_reduce_rows))
+    return process_stripes(pImage_data, rows_per_stripe, num_stripes);
+
+  while ((m_pass_num >= 1) && (m_pass_num <= 2))
+  {
+    for (int i = 0; i < m_src_y; i++)
+    {
+      if (!process_scanline(pImage_data + static_cast<size_t>(i) * m_image_bpl))
+        return false;
+    }
+    if (!process_scanline(NULL))
+      return false;
+  }
+  return m_all_stream_writes_succeeded;
+}
+
+// Each stripe is encoded by its own encoder into a segment_stream, starting with fresh DC predictors exactly like the
+// sequential encoder does after a restart marker, so the stitched result is identical to a single threaded encode.
+bool jpeg_encoder::process_stripes(const uint8 *pImage_data, int rows_per_stripe, int num_stripes)
+{
+  params segment_params(m_params);
+  segment_params.m_restart_interval = 0;
+  segment_params.m_max_threads = 1;
+
+  segment_stream *pSegments = new segment_stream[num_stripes];
+  for (int stripe = 0; stripe < num_stripes; stripe++)
+    pSegments[stripe].set_allocator(m_allocator);
+  std::atomic<int> next_stripe(0);
+  std::atomic<bool> status(true);
+
+  auto encode_stripes = [&]()
+  {
+    jpeg_encoder *pEncoder = acquire_encoder();
+    for (int stripe = next_stripe++; (stripe < num_stripes) && (status); stripe = next_stripe++)
+    {
+      // Stripes hold whole MCU rows, so in a reduced encode they also start on a block boundary of the source.
+      const int first_row = (stripe * rows_per_stripe) << m_reduce_shift, num_rows = JPGE_MIN(rows_per_stripe << m_reduce_shift, m_src_y - first_row);
+      if ((!pEncoder->open(&pSegments[stripe], m_src_x, num_rows, m_image_bpp, segment_params, &m_allocator, true)) ||
+          (!pEncoder->process_image(pImage_data + static_cast<size_t>(first_row) * m_image_bpl)))
+        status = false;
+    }
+    release_encoder(pEncoder);
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < JPGE_MIN(m_params.m_max_threads, num_stripes); i++)
+    threads.push_back(std::thread(encode_stripes));
+  encode_stripes();
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  if (status)
+  {
+    flush_output_buffer();
+    for (int stripe = 0; stripe < num_stripes; stripe++)
+    {
+      const uint8 *pBuf = pSegments[stripe].get_data();
+      for (size_t ofs = 0, size = pSegments[stripe].get_size(); ofs < size; )
+      {
+        const int len = static_cast<int>(JPGE_MIN(size - ofs, static_cast<size_t>(1) << 30));
+        STATS_COUNT(OUTPUT_BYTES, static_cast<uint64>(len));
+        m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(pBuf + ofs, len);
+        ofs += len;
+      }
+      if (stripe + 1 < num_stripes)
+        emit_marker(M_RST0 + (stripe & 7));
+    }
+    emit_marker(M_EOI);
+    m_pass_num = 3;
+  }
+
+  delete[] pSegments;
+  return status && m_all_stream_writes_succeeded;
+}
+
+#ifdef JPGE_BENCHMARK
+namespace bench {
+
+void rgb_to_ycc(uint8 *pDst, const uint8 *pSrc, int num_pixels) { RGB_to_YCC(pDst, pSrc, num_pixels); }
+
+void dct_2d(int32 *pBlock) { get_simd_kernels().m_DCT2D(pBlock); }
+
+bool code_blocks(output_stream *pStream, const int16 *pCoefficients, int num_blocks)
+{
+  params comp_params;
+  comp_params.m_subsampling = Y_ONLY;
+  jpeg_encoder encoder;
+  if (!encoder.init(pStream, 8, 8, 1, comp_params))
+    return false;
+  for (int i = 0; i < num_blocks; i++)
+  {
+    memcpy(encoder.m_coefficient_array, pCoefficients + static_cast<size_t>(i) * 64, sizeof(encoder.m_coefficient_array));
+    encoder.code_coefficients_pass_two(0, encoder.m_coefficient_array);
+  }
+  encoder.flush_bits();
+  encoder.flush_output_buffer();
+  return encoder.m_all_stream_writes_succeeded;
+}
+
+} // namespace bench
+#endif
+
+// Encoders released on a thread. The pool and the encoders in it are deleted when the thread exits.
+struct encoder_pool
+{
+  enum { MAX_ENCODERS = 4 };
+  std::vector<jpeg_encoder*> m_encoders;
+  ~encoder_pool() { for (size_t i = 0; i < m_encoders.size(); i++) delete m_encoders[i]; }
+};
+
+static thread_local encoder_pool s_encoder_pool;
+
+jpeg_encoder *acquire_encoder()
+{
+  if (s_encoder_pool.m_encoders.empty())
+    return new jpeg_encoder;
+  jpeg_encoder *pEncoder = s_encoder_pool.m_encoders.back();
+  s_encoder_pool.m_encoders.pop_back();
+  return pEncoder;
+}
+
+void release_encoder(jpeg_encoder *pEncoder)
+{
+  if (!pEncoder)
+    return;
+  pEncoder->reset();
+  if (s_encoder_pool.m_encoders.size() < encoder_pool::MAX_ENCODERS)
+    s_encoder_pool.m_encoders.push_back(pEncoder);
+  else
+    delete pEncoder;
+}
+
 // Higher level wrappers/examples (optional).
 #include <stdio.h>
 
@@ -924,6 +1757,7 @@ public:
 
    bool close()
    {
+      STATS_TIMER(WRITE_OUTPUT);
       if (m_pFile)
       {
          if (fclose(m_pFile) == EOF)
@@ -937,6 +1771,7 @@ public:
 
    virtual bool put_buf(const void* pBuf, int len)
    {
+      STATS_TIMER(WRITE_OUTPUT);
       m_bStatus = m_bStatus && (fwrite(pBuf, len, 1, m_pFile) == 1);
       return m_bStatus;
    }
@@ -949,28 +1784,26 @@ public:
 
 // Writes JPEG image to file.
 bool compress_image_to_jpeg_file(const char *pFilename, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
+{
+  jpeg_encoder *pEncoder = acquire_encoder();
+  const bool status = compress_image_to_jpeg_file(*pEncoder, pFilename, width, height, num_channels, pImage_data, comp_params);
+  release_encoder(pEncoder);
+  return status;
+}
+
+bool compress_image_to_jpeg_file(jpeg_encoder &dst_image, const char *pFilename, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params)
 {
   cfile_stream dst_stream;
   if (!dst_stream.open(pFilename))
     return false;
 
-  jpge::jpeg_encoder dst_image;
   if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
     return false;
 
-  for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
-  {
-    for (int i = 0; i < height; i++)
-    {
-       const uint8* pBuf = pImage_data + i * width * num_channels;
-       if (!dst_image.process_scanline(pBuf))
-          return false;
-    }
-    if (!dst_image.process_scanline(NULL))
-       return false;
-  }
+  if (!dst_image.process_image(pImage_data))
+    return false;
 
-  dst_image.deinit();
+  dst_image.reset();
 
   return dst_stream.close();
 }
@@ -993,11 +1826,19 @@ public:
       uint buf_remaining = m_buf_size - m_buf_ofs;
       if ((uint)len > buf_remaining)
          return false;
-      memcpy(m_pBuf + m_buf_ofs, pBuf, len);
+      // Already in place if the encoder coded into the space from reserve_buf().
+      if (pBuf != m_pBuf + m_buf_ofs)
+         memcpy(m_pBuf + m_buf_ofs, pBuf, len);
       m_buf_ofs += len;
       return true;
    }
 
+   virtual uint8 *reserve_buf(uint &size)
+   {
+      size = m_buf_size - m_buf_ofs;
+      return m_pBuf + m_buf_ofs;
+   }
+
    uint get_size() const
    {
       return m_buf_ofs;
@@ -1013,24 +1854,12 @@ bool compress_image_to_jpeg_file_in_memory(void *pDstBuf, int &buf_size, int wid
 
    buf_size = 0;
 
-   jpge::jpeg_encoder dst_image;
-   if (!dst_image.init(&dst_stream, width, height, num_channels, comp_params))
+   jpeg_encoder *pEncoder = acquire_encoder();
+   const bool status = pEncoder->init(&dst_stream, width, height, num_channels, comp_params) && pEncoder->process_image(pImage_data);
+   release_encoder(pEncoder);
+   if (!status)
       return false;
 
-   for (uint pass_index = 0; pass_index < dst_image.get_total_passes(); pass_index++)
-   {
-     for (int i = 0; i < height; i++)
-     {
-        const uint8* pScanline = pImage_data + i * width * num_channels;
-        if (!dst_image.process_scanline(pScanline))
-           return false;
-     }
-     if (!dst_image.process_scanline(NULL))
-        return false;
-   }
-
-   dst_image.deinit();
-
    buf_size = dst_stream.get_size();
    return true;
 }
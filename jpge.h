@@ -4,6 +4,8 @@
 #ifndef JPEG_ENCODER_H
 #define JPEG_ENCODER_H
 
+#include <stddef.h>
+
 namespace jpge
 {
   typedef unsigned char  uint8;
@@ -12,6 +14,7 @@ namespace jpge
   typedef unsigned short uint16;
   typedef unsigned int   uint32;
   typedef unsigned int   uint;
+  typedef unsigned long long uint64;
   
   // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
   enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
@@ -19,12 +22,15 @@ namespace jpge
   // JPEG compression parameters structure.
   struct params
   {
-    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false) { }
+    inline params() : m_quality(85), m_subsampling(H2V2), m_no_chroma_discrim_flag(false), m_two_pass_flag(false), m_restart_interval(0), m_max_threads(1), m_reduction(1) { }
 
     inline bool check() const
     {
       if ((m_quality < 1) || (m_quality > 100)) return false;
       if ((uint)m_subsampling > (uint)H2V2) return false;
+      if (m_restart_interval > 0xFFFF) return false;
+      if (m_max_threads < 1) return false;
+      if ((m_reduction != 1) && (m_reduction != 2) && (m_reduction != 4) && (m_reduction != 8)) return false;
       return true;
     }
 
@@ -42,7 +48,22 @@ namespace jpge
     // If true, the Y quantization table is also used for the CbCr channels.
     bool m_no_chroma_discrim_flag;
 
+    // Builds optimized Huffman tables. The quantized coefficients of the whole image are kept in a compact buffer
+    // while their statistics are gathered, then entropy coded from there, so the image is still only fed once.
     bool m_two_pass_flag;
+
+    // Number of MCUs between restart markers, 0 = no restart markers.
+    uint m_restart_interval;
+
+    // Maximum number of threads jpeg_encoder::process_image() may use. Values above 1 split the image into horizontal
+    // stripes of whole MCU rows that are entropy coded concurrently and joined by restart markers. If m_restart_interval
+    // is 0, a stripe height giving about two stripes per thread is picked. Ignored in two pass mode.
+    int m_max_threads;
+
+    // 1, 2, 4 or 8. Encodes the image at 1/m_reduction of the width and height passed to init(), rounded up. Each pixel is the
+    // mean of an m_reduction x m_reduction block of source pixels, averaged as the scanlines are loaded, so the source is
+    // still fed at full size but only the reduced image is color converted and coded.
+    uint m_reduction;
   };
   
   // Writes JPEG image to a file. 
@@ -54,16 +75,88 @@ namespace jpge
   // If return value is true, buf_size will be set to the size of the compressed data.
   bool compress_image_to_jpeg_file_in_memory(void *pBuf, int &buf_size, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
     
+  // Memory functions used for the encoder's buffers. m_pUser is passed to every call. m_realloc may be NULL, in which
+  // case growing a buffer allocates a new one, copies and frees the old one.
+  struct allocator
+  {
+    void *(*m_malloc)(size_t size, void *pUser);
+    void *(*m_realloc)(void *p, size_t size, void *pUser);
+    void (*m_free)(void *p, void *pUser);
+    void *m_pUser;
+  };
+
+  // Sets the allocator of encoders whose init() is not given one. NULL restores malloc/realloc/free. Takes effect on the
+  // next init() of each encoder, so set it before encoding starts rather than while other threads are encoding.
+  void set_allocator(const allocator *pAllocator);
+
   // Output stream abstract class - used by the jpeg_encoder class to write to the output stream. 
-  // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
+  // put_buf() is generally called with a full output buffer (64KB unless jpeg_encoder::set_output_buffer() was used), but for headers it'll be called with smaller amounts.
   class output_stream
   {
   public:
     virtual ~output_stream() { };
     virtual bool put_buf(const void* Pbuf, int len) = 0;
     template<class T> inline bool put_obj(const T& obj) { return put_buf(&obj, sizeof(T)); }
+
+    // Optional. Returns writable space of at least 16 bytes at the end of the stream and sets size to its length, or NULL.
+    // The encoder then codes straight into it and passes the filled part back to put_buf(), which only has to take the
+    // bytes over instead of copying them. Any other put_buf() call may invalidate the space.
+    virtual uint8 *reserve_buf(uint &size) { size = 0; return NULL; }
+  };
+
+  // Growable in-memory output made of a chain of chunks that the encoder writes into directly, so the JPEG is never
+  // copied or flattened. get_chunk() describes it piece by piece, e.g. to fill the iovecs of writev(). Chunks start at
+  // chunk_size bytes and grow with the total size; they come from pAllocator (NULL for the one set by set_allocator())
+  // and are kept by clear() for the next image.
+  class chunk_stream : public output_stream
+  {
+  public:
+    explicit chunk_stream(uint chunk_size = 64 * 1024, const allocator *pAllocator = NULL);
+    virtual ~chunk_stream();
+
+    virtual bool put_buf(const void* pBuf, int len);
+    virtual uint8 *reserve_buf(uint &size);
+
+    // Number of chunks holding data, and the data of chunk i (size is set to its length).
+    uint get_num_chunks() const;
+    const uint8 *get_chunk(uint i, size_t &size) const;
+
+    // Total number of bytes written.
+    size_t get_size() const { return m_size; }
+
+    void clear();
+
+  private:
+    chunk_stream(const chunk_stream &);
+    chunk_stream &operator =(const chunk_stream &);
+
+    struct chunk { uint8 *m_pData; uint m_capacity, m_used; };
+
+    allocator m_allocator;
+    uint m_chunk_size;
+    chunk *m_pChunks;
+    uint m_num_chunks, m_max_chunks, m_num_used;
+    size_t m_size;
+
+    bool next_chunk();
   };
     
+#ifdef JPGE_BENCHMARK
+  // Inner stages of the encoder on their own, for bench.c. Only compiled in with JPGE_BENCHMARK defined.
+  namespace bench
+  {
+    // Colour conversion of num_pixels RGB pixels to interleaved YCbCr, with the kernel picked for the running CPU.
+    void rgb_to_ycc(uint8 *pDst, const uint8 *pSrc, int num_pixels);
+
+    // Forward DCT of one 8x8 block of level shifted samples, in place.
+    void dct_2d(int32 *pBlock);
+
+    // Huffman codes num_blocks blocks of 64 quantized coefficients (zigzag order) with the standard luma tables
+    // through the encoder's bit writer, sending the result to pStream.
+    bool code_blocks(output_stream *pStream, const int16 *pCoefficients, int num_blocks);
+  }
+#endif
+
   // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
   class jpeg_encoder
   {
@@ -76,34 +169,58 @@ namespace jpge
     // params - Compression parameters structure, defined above.
     // width, height  - Image dimensions.
     // channels - May be 1, or 3. 1 indicates grayscale, 3 indicates RGB source data.
+    // pAllocator - Allocator for the encoder's buffers, NULL for the one set by set_allocator(). Buffers kept from a
+    // previous image made with a different allocator are freed first.
     // Returns false on out of memory or if a stream write fails.
-    bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
+    bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params(), const allocator *pAllocator = NULL);
     
     const params &get_params() const { return m_params; }
+
+    // Makes the encoder collect entropy coded data in a caller-owned buffer instead of its own 64KB one, so the stream sees
+    // fewer, larger put_buf() calls. buf_size must be at least 16 bytes; NULL switches back to the internal buffer.
+    // Takes effect on the next init() and the buffer must stay valid until deinit(). Not used while the stream offers
+    // space through output_stream::reserve_buf().
+    bool set_output_buffer(void *pBuf, uint buf_size);
     
     // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
     void deinit();
 
-    uint get_total_passes() const { return m_params.m_two_pass_flag ? 2 : 1; }
+    // Ends the current image like deinit() but keeps the allocated buffers and cached tables. A following init() with
+    // the same or a smaller image, and the same quality, then neither allocates nor recomputes tables. init() resets
+    // implicitly.
+    void reset();
+
+    // Always 1: in two pass mode the second pass runs over buffered coefficients when the last scanline arrives.
+    uint get_total_passes() const { return 1; }
     inline uint get_cur_pass() { return m_pass_num; }
 
     // Call this method with each source scanline.
-    // width * src_channels bytes per scanline is expected (RGB or Y format).
+    // width * src_channels bytes per scanline is expected (RGB or Y format), width and height being the source size given to init().
     // You must call with NULL after all scanlines are processed to finish compression.
     // Returns false on out of memory or if a stream write fails.
     bool process_scanline(const void* pScanline);
+
+    // Compresses a whole image (height scanlines of width * src_channels bytes) in one call, running all passes.
+    // Use instead of process_scanline(). Uses up to m_max_threads threads if the restart interval spans whole MCU rows.
+    bool process_image(const uint8 *pImage_data);
         
   private:
     jpeg_encoder(const jpeg_encoder &);
     jpeg_encoder &operator =(const jpeg_encoder &);
 
+#ifdef JPGE_BENCHMARK
+    friend bool bench::code_blocks(output_stream *pStream, const int16 *pCoefficients, int num_blocks);
+#endif
+
     typedef int32 sample_array_t;
         
     output_stream *m_pStream;
     params m_params;
+    allocator m_allocator;
     uint8 m_num_components;
     uint8 m_comp_h_samp[3], m_comp_v_samp[3];
     int m_image_x, m_image_y, m_image_bpp, m_image_bpl;
+    int m_src_x, m_src_y;
     int m_image_x_mcu, m_image_y_mcu;
     int m_image_bpl_xlt, m_image_bpl_mcu;
     int m_mcus_per_row;
@@ -113,20 +230,41 @@ namespace jpge
     sample_array_t m_sample_array[64];
     int16 m_coefficient_array[64];
     int32 m_quantization_tables[2][64];
+    int32 m_quantization_natural[2][64], m_quantization_recip[2][64];
     uint m_huff_codes[4][256];
     uint8 m_huff_code_sizes[4][256];
     uint8 m_huff_bits[4][17];
     uint8 m_huff_val[4][256];
     uint32 m_huff_count[4][256];
     int m_last_dc_val[3];
-    enum { JPGE_OUT_BUF_SIZE = 2048 };
-    uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
+    enum { JPGE_OUT_BUF_SIZE = 64 * 1024, JPGE_MIN_OUT_BUF_SIZE = 16 };
+    uint8 *m_pUser_out_buf;
+    uint m_user_out_buf_size;
+    uint8 *m_pOwn_out_buf;
+    uint m_own_out_buf_size;
+    uint8 *m_out_buf;
+    uint m_out_buf_size;
     uint8 *m_pOut_buf;
     uint m_out_buf_left;
-    uint32 m_bit_buffer;
+    uint64 m_bit_buffer;
     uint m_bits_in;
     uint8 m_pass_num;
     bool m_all_stream_writes_succeeded;
+    bool m_segment_only;
+    uint m_mcus_coded;
+    uint8 *m_pBlock_buf;
+    size_t m_block_buf_size, m_block_buf_ofs;
+    uint8 *m_pWork_buf;
+    size_t m_work_buf_size;
+    int m_quant_quality;
+    bool m_quant_no_chroma_discrim;
+    bool m_std_huff_tables;
+    int m_reduce_shift, m_reduce_rows;
+    uint16 *m_pReduce_sums;
+    uint8 *m_pReduce_line;
+    int16 *m_pRow_coefs;
+    int m_blocks_per_mcu;
+    uint8 m_block_components[6];
         
     void optimize_huffman_table(int table_num, int table_len);
     void emit_byte(uint8 i);
@@ -138,6 +276,7 @@ namespace jpge
     void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
     void emit_dhts();
     void emit_sos();
+    void emit_dri();
     void emit_markers();
     void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val);
     void compute_quant_table(int32 *dst, int16 *src);
@@ -145,16 +284,26 @@ namespace jpge
     void first_pass_init();
     bool second_pass_init();
     bool jpg_open(int p_x_res, int p_y_res, int src_channels);
+    bool open(output_stream *pStream, int width, int height, int src_channels, const params &comp_params, const allocator *pAllocator, bool segment_only);
+    bool process_stripes(const uint8 *pImage_data, int rows_per_stripe, int num_stripes);
+    void load_reduced_scanline(const uint8 *pSrc);
+    void flush_reduced_scanline();
     void load_block_8_8_grey(int x);
     void load_block_8_8(int x, int y, int c);
     void load_block_16_8(int x, int c);
     void load_block_16_8_8(int x, int c);
-    void load_quantized_coefficients(int component_num);
+    void transform_block(int component_num, int16 *&pDst);
     void flush_output_buffer();
+    void reserve_output_buffer();
     void put_bits(uint bits, uint len);
-    void code_coefficients_pass_one(int component_num);
-    void code_coefficients_pass_two(int component_num);
-    void code_block(int component_num);
+    void flush_bits();
+    void emit_restart();
+    void begin_mcu();
+    void code_coefficients_pass_one(int component_num, const int16 *src);
+    void code_coefficients_pass_two(int component_num, const int16 *pSrc);
+    void code_block(int component_num, const int16 *pSrc);
+    void buffer_block(const int16 *pSrc);
+    void code_buffered_blocks();
     void process_mcu_row();
     bool terminate_pass_one();
     bool terminate_pass_two();
@@ -164,6 +313,15 @@ namespace jpge
     void init();
   };
 
+  // Encoders for repeated use on one thread: acquire_encoder() returns one released earlier on the calling thread, with
+  // its buffers and tables, or a new one. Released encoders beyond a few per thread are deleted. Pooled encoders keep their
+  // buffers, and the allocator they came from, until they are reused or the thread exits.
+  jpeg_encoder *acquire_encoder();
+  void release_encoder(jpeg_encoder *pEncoder);
+
+  // Same as compress_image_to_jpeg_file() above, but encodes with a caller-owned encoder so it can be reused across images.
+  bool compress_image_to_jpeg_file(jpeg_encoder &encoder, const char *pFilename, int width, int height, int num_channels, const uint8 *pImage_data, const params &comp_params = params());
+
 } // namespace jpge
 
 #endif // JPEG_ENCODER
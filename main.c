@@ -1,73 +1,256 @@
-#include "jpge.h"
-#include "parser.h"
+#include "convert.h"
+#include "frames.h"
+#include "stats.h"
 
-#include <iterator>
-#include <climits>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
 
-bool endsWith(std::string const &str, std::string const &suffix) {
-    if (str.length() < suffix.length()) {
+// In-memory share of the thumbnail cache; anything beyond it is only kept in the cache directory.
+static const uint64_t cacheMemoryBytes = 64 << 20;
+
+static void printUsage() {
+    printf("Usage: parser [-caff | -ciff] path-to-file [-cache dir] [-size WxH]\n");
+    printf("       parser -batch [-j threads] [-cache dir] [-size WxH] [-list file | -list -] [path-to-file ...]\n");
+    printf("       parser -frames [-j threads] [-avi] path-to-caff-file\n");
+    printf("       parser -validate path-to-file ...\n");
+    printf("Any of these may add --stats or --stats=json to print time per stage and counters when done.\n");
+}
+
+static bool readList(std::istream &in, std::vector<std::string> &filePaths) {
+    std::string line;
+
+    while (std::getline(in, line)) {
+        if (!line.empty()) {
+            filePaths.push_back(line);
+        }
+    }
+
+    return !in.bad();
+}
+
+// Parses a WxH size limit, where either side may be 0 for no limit.
+static bool parseSize(const char *text, uint32_t &width, uint32_t &height) {
+    char *end;
+    unsigned long w = strtoul(text, &end, 10);
+
+    if (end == text || *end != 'x') {
         return false;
     }
-    return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+
+    const char *rest = end + 1;
+    unsigned long h = strtoul(rest, &end, 10);
+
+    if (end == rest || *end != '\0' || w > UINT32_MAX || h > UINT32_MAX) {
+        return false;
+    }
+
+    width = (uint32_t) w;
+    height = (uint32_t) h;
+    return true;
 }
 
-int main(int argc, char** argv)
+static int runBatch(int argc, char** argv)
 {
-    if (argc != 3) {
-        printf("Usage: parser [-caff | -ciff] path-to-file \n");
-        return -1;
-    }
+    unsigned jobs = std::thread::hardware_concurrency();
+    std::vector<std::string> filePaths;
+    std::unique_ptr<converter::ThumbnailCache> cache;
+    converter::Context settings;
+    bool listGiven = false;
 
-    std::string fileType = argv[1];
-    std::string filePath = argv[2];
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
 
-    if (fileType == "-caff" && endsWith(filePath, ".caff"))
-    {
-        parser::CAFF caff;
-        if (!parser::parseCaffFile(filePath, caff)) {
-            printf("Failed to parse CAFF file.\n");
-            return -1;
+        if (arg == "-j" && i + 1 < argc) {
+            jobs = (unsigned) strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "-cache" && i + 1 < argc) {
+            cache.reset(new converter::ThumbnailCache(cacheMemoryBytes, argv[++i]));
+        } else if (arg == "-size" && i + 1 < argc) {
+            if (!parseSize(argv[++i], settings.maxWidth, settings.maxHeight)) {
+                printUsage();
+                return -1;
+            }
+        } else if (arg == "-list" && i + 1 < argc) {
+            std::string listPath = argv[++i];
+            listGiven = true;
+
+            if (listPath == "-") {
+                readList(std::cin, filePaths);
+            } else {
+                std::ifstream list(listPath);
+
+                if (!list || !readList(list, filePaths)) {
+                    printf("Failed to read list file %s.\n", listPath.c_str());
+                    return -1;
+                }
+            }
+        } else {
+            filePaths.push_back(arg);
         }
+    }
+
+    if (filePaths.empty() && !listGiven) {
+        readList(std::cin, filePaths);
+    }
 
-        filePath.erase(filePath.length()-5);
-        filePath = filePath + ".jpg";
+    settings.cache = cache.get();
+    bool success = converter::convertBatch(filePaths, jobs, settings);
 
-        if (caff.animations[0].ciff.width > INT_MAX || caff.animations[0].ciff.height > INT_MAX) {
-            printf("Error while saving JPG: First CIFF image size too large.\n");
+    if (cache) {
+        converter::ThumbnailCache::Stats stats = cache->stats();
+        printf("Cache: %llu memory hits, %llu disk hits, %llu misses\n", (unsigned long long) stats.memoryHits,
+               (unsigned long long) stats.diskHits, (unsigned long long) stats.misses);
+    }
+
+    return success ? 0 : -1;
+}
+
+static int runFrames(int argc, char** argv)
+{
+    unsigned jobs = std::thread::hardware_concurrency();
+    converter::FrameFormat format = converter::FrameFormat::JPEG_SEQUENCE;
+    std::string filePath;
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-j" && i + 1 < argc) {
+            jobs = (unsigned) strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "-avi") {
+            format = converter::FrameFormat::MJPEG_AVI;
+        } else if (filePath.empty()) {
+            filePath = arg;
+        } else {
+            printUsage();
             return -1;
         }
+    }
 
-        if (!jpge::compress_image_to_jpeg_file(filePath.c_str(), (int)caff.animations[0].ciff.width, (int)caff.animations[0].ciff.height, 3, (jpge::uint8*)(caff.animations[0].ciff.pixels.data()))) {
-            printf("Unexpected error while saving first CIFF image as JPG.\n");
-            return -1;
-		}
+    converter::FileType type;
+    if (!converter::fileTypeOf(filePath, type) || type != converter::FileType::CAFF) {
+        printUsage();
+        return -1;
     }
-    else if (fileType == "-ciff" && endsWith(filePath, ".ciff"))
-    {
-        parser::CIFF ciff;
-        if (!parser::parseCiffFile(filePath, ciff)) {
-            printf("Failed to parse CIFF file.\n");
-            return -1;
+
+    return converter::exportFrames(filePath, format, jobs, jpge::params()) ? 0 : -1;
+}
+
+// Checks the headers of every file without decoding it and prints one "VALID path" / "INVALID path: reason" line each.
+static int runValidate(int argc, char** argv)
+{
+    bool allValid = argc > 2;
+
+    for (int i = 2; i < argc; i++) {
+        converter::FileType type;
+
+        if (!converter::fileTypeOf(argv[i], type)) {
+            printf("INVALID %s: Unknown file type\n", argv[i]);
+            allValid = false;
+            continue;
         }
 
-        filePath.erase(filePath.length()-5);
-        filePath = filePath + ".jpg";
+        parser::VALIDATION verdict = type == converter::FileType::CAFF ? parser::validateCaffFile(argv[i]) : parser::validateCiffFile(argv[i]);
 
-        if (ciff.width > INT_MAX || ciff.height > INT_MAX) {
-            printf("Error while saving JPG: CIFF image size too large.\n");
-            return -1;
+        if (verdict.valid()) {
+            printf("VALID %s\n", argv[i]);
+        } else {
+            printf("INVALID %s: %s at offset %llu (block %llu)\n", argv[i], parser::errorMessage(verdict.error.code),
+                   (unsigned long long) verdict.error.offset, (unsigned long long) verdict.error.block);
+            allValid = false;
         }
+    }
 
-        if (!jpge::compress_image_to_jpeg_file(filePath.c_str(), (int)ciff.width, (int)ciff.height, 3, (jpge::uint8*)(ciff.pixels.data()))) {
-            printf("Unexpected error while saving CIFF image as JPG.\n");
-            return -1;
-		}
+    return allValid ? 0 : -1;
+}
+
+static int run(int argc, char** argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "-batch") {
+        return runBatch(argc, argv);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "-frames") {
+        return runFrames(argc, argv);
     }
-    else
+
+    if (argc >= 2 && std::string(argv[1]) == "-validate") {
+        return runValidate(argc, argv);
+    }
+
+    if (argc < 3) {
+        printUsage();
+        return -1;
+    }
+
+    std::string fileType = argv[1];
+    std::string filePath = argv[2];
+
+    converter::FileType type;
+    if (!converter::fileTypeOf(filePath, type) ||
+        (type == converter::FileType::CAFF && fileType != "-caff") ||
+        (type == converter::FileType::CIFF && fileType != "-ciff"))
     {
-        printf("Usage: parser [-caff | -ciff] path-to-file \n");
+        printUsage();
+        return -1;
+    }
+
+    // A single image gets all cores through striped parallel encoding; batch mode parallelizes across files instead.
+    converter::Context context;
+    context.params.m_max_threads = (int) std::max(1u, std::thread::hardware_concurrency());
+    std::unique_ptr<converter::ThumbnailCache> cache;
+
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-cache" && i + 1 < argc) {
+            cache.reset(new converter::ThumbnailCache(cacheMemoryBytes, argv[++i]));
+            context.cache = cache.get();
+        } else if (arg == "-size" && i + 1 < argc && parseSize(argv[i + 1], context.maxWidth, context.maxHeight)) {
+            i++;
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    if (!converter::convertFile(type, filePath, context)) {
+        printf("%s\n", context.error.c_str());
         return -1;
     }
 
     return 0;
 }
+
+// The statistics go to stderr, so they do not mix with the output of the command.
+int main(int argc, char** argv)
+{
+    enum class StatsFormat {NONE, TEXT, JSON} statsFormat = StatsFormat::NONE;
+    std::vector<char *> args;
+
+    for (int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--stats" || arg == "--stats=text") {
+            statsFormat = StatsFormat::TEXT;
+        } else if (arg == "--stats=json") {
+            statsFormat = StatsFormat::JSON;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    args.push_back(nullptr);
+    int result = run((int) args.size() - 1, args.data());
+
+    if (statsFormat != StatsFormat::NONE) {
+        stats::Snapshot snapshot = stats::snapshot();
+        std::string report = statsFormat == StatsFormat::JSON ? stats::formatJson(snapshot) : stats::formatText(snapshot);
+        fputs(report.c_str(), stderr);
+    }
+
+    return result;
+}
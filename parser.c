@@ -1,10 +1,95 @@
 #include "parser.h"
 
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <fstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace parser {
-    bool datacopy(void *to, const std::vector<char> &from, uint64_t &pos, uint64_t count) {
+    static const uint64_t hashPrime1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t hashPrime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const uint64_t hashPrime3 = 0x165667B19E3779F9ULL;
+    static const uint64_t hashPrime4 = 0x85EBCA77C2B2AE63ULL;
+    static const uint64_t hashPrime5 = 0x27D4EB2F165667C5ULL;
+
+    static inline uint64_t rotl64(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static inline uint64_t read64(const char *data) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static inline uint64_t hashRound(uint64_t accumulator, uint64_t input) {
+        return rotl64(accumulator + input * hashPrime2, 31) * hashPrime1;
+    }
+
+    static inline uint64_t hashMerge(uint64_t hash, uint64_t lane) {
+        return (hash ^ hashRound(0, lane)) * hashPrime1 + hashPrime4;
+    }
+
+    uint64_t hashPixels(const char *data, uint64_t size) {
+        const char *end = data + size;
+        uint64_t hash;
+
+        if (size >= 32) {
+            uint64_t lane1 = hashPrime1 + hashPrime2;
+            uint64_t lane2 = hashPrime2;
+            uint64_t lane3 = 0;
+            uint64_t lane4 = 0 - hashPrime1;
+
+            for (; end - data >= 32; data += 32) {
+                lane1 = hashRound(lane1, read64(data));
+                lane2 = hashRound(lane2, read64(data + 8));
+                lane3 = hashRound(lane3, read64(data + 16));
+                lane4 = hashRound(lane4, read64(data + 24));
+            }
+
+            hash = rotl64(lane1, 1) + rotl64(lane2, 7) + rotl64(lane3, 12) + rotl64(lane4, 18);
+            hash = hashMerge(hash, lane1);
+            hash = hashMerge(hash, lane2);
+            hash = hashMerge(hash, lane3);
+            hash = hashMerge(hash, lane4);
+        } else {
+            hash = hashPrime5;
+        }
+
+        hash += size;
+
+        for (; end - data >= 8; data += 8) {
+            hash = rotl64(hash ^ hashRound(0, read64(data)), 27) * hashPrime1 + hashPrime4;
+        }
+
+        if (end - data >= 4) {
+            uint32_t value;
+            std::memcpy(&value, data, sizeof(value));
+            hash = rotl64(hash ^ (value * hashPrime1), 23) * hashPrime2 + hashPrime3;
+            data += 4;
+        }
+
+        for (; data < end; data++) {
+            hash = rotl64(hash ^ ((uint8_t) *data * hashPrime5), 11) * hashPrime1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= hashPrime2;
+        hash ^= hash >> 29;
+        hash *= hashPrime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    bool datacopy(void *to, ByteSpan from, uint64_t &pos, uint64_t count) {
         if (count > 0) {
             uint64_t startingPos = pos;
 
@@ -12,14 +97,14 @@ namespace parser {
                 return false;
             }
 
-            uint64_t length = from.size();
+            uint64_t length = from.size;
 
             if (count > UINT64_MAX - pos || pos + count > length) {
                 return false;
             }
 
             if (to != nullptr) {
-                std::memcpy(to, from.data() + pos, count);
+                std::memcpy(to, from.data + pos, count);
             }
 
             pos += count;
@@ -32,155 +117,286 @@ namespace parser {
         return true;
     }
 
-    bool parseCiff(const std::vector<char> &buffer, uint64_t &pos, CIFF &ciff) {
+    bool datacopy(void *to, const std::vector<char> &from, uint64_t &pos, uint64_t count) {
+        return datacopy(to, ByteSpan(from), pos, count);
+    }
+
+    static thread_local PARSE_ERROR lastError = {ErrorCode::NONE, 0, 0};
+
+    const PARSE_ERROR &parseError() {
+        return lastError;
+    }
+
+    bool setParseError(ErrorCode code, uint64_t offset, uint64_t block) {
+        lastError = PARSE_ERROR{code, offset, block};
+        return false;
+    }
+
+    static bool fail(ErrorCode code, uint64_t offset) {
+        return setParseError(code, offset, 0);
+    }
+
+    // Attributes the error just recorded by a block parser to the block with the given index.
+    static bool failInBlock(uint64_t block) {
+        lastError.block = block;
+        return false;
+    }
+
+    // content_size must be width * height * 3 without overflowing. Images with a side of 0 are rejected.
+    static bool ciffContentSizeValid(const CIFF_VIEW &ciff) {
+        return ciff.width != 0 && ciff.height != 0 && ciff.width <= UINT64_MAX / 3 / ciff.height &&
+               ciff.width * ciff.height * 3 == ciff.content_size;
+    }
+
+    namespace {
+        // Where the block walker below reads from. Both readers have the semantics of datacopy(): read() copies count
+        // bytes at pos into to, or only checks they exist if to is nullptr, and advances pos past them.
+
+        // Reads from memory. pixels() points into the buffer, so parsed views reference it.
+        class SpanReader {
+        public:
+            explicit SpanReader(ByteSpan bytes) : bytes(bytes) {}
+
+            ErrorCode read(void *to, uint64_t &pos, uint64_t count) {
+                return datacopy(to, bytes, pos, count) ? ErrorCode::NONE : ErrorCode::TRUNCATED;
+            }
+
+            uint64_t size() const { return bytes.size; }
+
+            const char *pixels(uint64_t pos) const { return bytes.data + pos; }
+
+        private:
+            ByteSpan bytes;
+        };
+
+        // Reads from a file through a small window, so reading the headers of neighbouring small blocks takes a single
+        // pread(). Used by the validators, which never look at pixels.
+        class WindowReader {
+        public:
+            WindowReader(int fd, uint64_t size) : fd(fd), fileSize(size) {}
+
+            ErrorCode read(void *to, uint64_t &pos, uint64_t count) {
+                if (count > fileSize || pos > fileSize - count) {
+                    return ErrorCode::TRUNCATED;
+                }
+
+                if (to != nullptr && count > sizeof(window)) {
+                    if (!readFully(static_cast<char *>(to), pos, count)) {
+                        return ErrorCode::READ_FAILED;
+                    }
+                } else if (to != nullptr && count > 0) {
+                    if (pos < windowStart || pos + count > windowStart + windowSize) {
+                        ssize_t got;
+
+                        do {
+                            got = pread(fd, window, sizeof(window), (off_t) pos);
+                        } while (got < 0 && errno == EINTR);
+
+                        windowStart = pos;
+                        windowSize = got < 0 ? 0 : (uint64_t) got;
+
+                        if (windowSize < count) {
+                            return ErrorCode::READ_FAILED;
+                        }
+                    }
+
+                    std::memcpy(to, window + (pos - windowStart), count);
+                }
+
+                pos += count;
+                return ErrorCode::NONE;
+            }
+
+            uint64_t size() const { return fileSize; }
+
+            const char *pixels(uint64_t) const { return nullptr; }
+
+        private:
+            // For fields larger than the window, such as a long creator, which bypass it.
+            bool readFully(char *to, uint64_t pos, uint64_t count) {
+                while (count > 0) {
+                    ssize_t got = pread(fd, to, (size_t) count, (off_t) pos);
+
+                    if (got < 0 && errno == EINTR) {
+                        continue;
+                    }
+
+                    if (got <= 0) {
+                        return false;
+                    }
+
+                    to += got;
+                    pos += (uint64_t) got;
+                    count -= (uint64_t) got;
+                }
+
+                return true;
+            }
+
+            int fd;
+            uint64_t fileSize;
+            char window[4096];
+            uint64_t windowStart = 0;
+            uint64_t windowSize = 0;
+        };
+    }
+
+    template<typename Reader>
+    static bool readField(Reader &reader, void *to, uint64_t &pos, uint64_t count) {
+        uint64_t fieldPos = pos;
+        ErrorCode error = reader.read(to, pos, count);
+        return error == ErrorCode::NONE || fail(error, fieldPos);
+    }
+
+    // parseCiff() without counting the bytes, for images that are counted as part of their animation block. ciff.pixels
+    // is nullptr when reading from a WindowReader.
+    template<typename Reader>
+    static bool readCiff(Reader &reader, uint64_t &pos, CIFF_VIEW &ciff) {
         uint64_t startingPos = pos;
 
-        if (!datacopy(ciff.magic, buffer, pos, sizeof(ciff.magic))) {
-            printf("Failed to read CIFF magic.\n");
+        if (!readField(reader, ciff.magic, pos, sizeof(ciff.magic))) {
             return false;
         }
 
         if (ciff.magic[0] != 'C' || ciff.magic[1] != 'I' || ciff.magic[2] != 'F' || ciff.magic[3] != 'F') {
-            printf("Invalid CIFF magic.\n");
-            return false;
+            return fail(ErrorCode::INVALID_MAGIC, startingPos);
         }
 
-        if (!datacopy(&ciff.header_size, buffer, pos, sizeof(ciff.header_size))) {
-            printf("Failed to read CIFF header_size.\n");
+        if (!readField(reader, &ciff.header_size, pos, sizeof(ciff.header_size))) {
             return false;
         }
 
         if (ciff.header_size <
             sizeof(ciff.magic) + sizeof(ciff.header_size) + sizeof(ciff.content_size) + sizeof(ciff.width) +
             sizeof(ciff.height)) {
-            printf("Invalid CIFF header_size.\n");
-            return false;
+            return fail(ErrorCode::INVALID_HEADER_SIZE, pos - sizeof(ciff.header_size));
         }
 
-        if (!datacopy(&ciff.content_size, buffer, pos, sizeof(ciff.content_size))) {
-            printf("Failed to read CIFF content_size.\n");
+        if (!readField(reader, &ciff.content_size, pos, sizeof(ciff.content_size)) ||
+            !readField(reader, &ciff.width, pos, sizeof(ciff.width)) ||
+            !readField(reader, &ciff.height, pos, sizeof(ciff.height))) {
             return false;
         }
 
-        if (!datacopy(&ciff.width, buffer, pos, sizeof(ciff.width))) {
-            printf("Failed to read CIFF width.\n");
-            return false;
+        if (!ciffContentSizeValid(ciff) || ciff.content_size > SIZE_MAX) {
+            return fail(ErrorCode::INVALID_CONTENT_SIZE, startingPos + sizeof(ciff.magic) + sizeof(ciff.header_size));
         }
 
-        if (!datacopy(&ciff.height, buffer, pos, sizeof(ciff.height))) {
-            printf("Failed to read CIFF height.\n");
-            return false;
-        }
+        pos = startingPos;
 
-        if (ciff.width * ciff.height * 3 != ciff.content_size ||
-            ciff.width > ciff.content_size ||
-            ciff.height > ciff.content_size ||
-            ciff.width * ciff.height > UINT64_MAX / 3 ||
-            ciff.width > UINT64_MAX / ciff.height / 3 ||
-            ciff.height > UINT64_MAX / ciff.width / 3) {
-            printf("Invalid CIFF content_size.\n");
+        if (!readField(reader, nullptr, pos, ciff.header_size)) {
             return false;
         }
 
-        pos = startingPos;
+        ciff.pixels = reader.pixels(pos);
 
-        if (!datacopy(nullptr, buffer, pos, ciff.header_size)) {
-            printf("Unexpected error while parsing CIFF.\n");
-            return false;
-        }
+        return readField(reader, nullptr, pos, ciff.content_size);
+    }
+
+    static bool parseCiffAt(ByteSpan buffer, uint64_t &pos, CIFF_VIEW &ciff) {
+        SpanReader reader(buffer);
+        return readCiff(reader, pos, ciff);
+    }
 
-        if (ciff.content_size > SIZE_MAX) {
-            printf("CIFF content_size is too large.\n");
+    bool parseCiff(ByteSpan buffer, uint64_t &pos, CIFF_VIEW &ciff) {
+        if (!parseCiffAt(buffer, pos, ciff)) {
             return false;
         }
 
-        ciff.pixels.resize(ciff.content_size);
+        STATS_COUNT(BYTES_PARSED, ciff.header_size + ciff.content_size);
+        return true;
+    }
+
+    static void copyCiffHeader(const CIFF_VIEW &view, CIFF &ciff) {
+        std::memcpy(ciff.magic, view.magic, sizeof(ciff.magic));
+        ciff.header_size = view.header_size;
+        ciff.content_size = view.content_size;
+        ciff.width = view.width;
+        ciff.height = view.height;
+    }
+
+    static void copyCiff(const CIFF_VIEW &view, CIFF &ciff) {
+        STATS_TIMER(PIXEL_COPY);
+        copyCiffHeader(view, ciff);
+        ciff.pixels = std::make_shared<const std::vector<char>>(view.pixels, view.pixels + view.content_size);
+    }
+
+    bool parseCiff(ByteSpan buffer, uint64_t &pos, CIFF &ciff) {
+        CIFF_VIEW view;
 
-        if (!datacopy(ciff.pixels.data(), buffer, pos, ciff.content_size)) {
-            printf("Error while parsing CIFF pixels.\n");
+        if (!parseCiff(buffer, pos, view)) {
             return false;
         }
 
+        copyCiff(view, ciff);
+
         return true;
     }
 
-    bool parseCaffHeader(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_HEADER &caffHeader) {
+    bool parseCiff(const std::vector<char> &buffer, uint64_t &pos, CIFF &ciff) {
+        return parseCiff(ByteSpan(buffer), pos, ciff);
+    }
+
+    template<typename Reader>
+    static bool readCaffHeader(Reader &reader, uint64_t blockLength, uint64_t &pos, CAFF_HEADER &caffHeader) {
         uint64_t startingPos = pos;
 
-        if (!datacopy(caffHeader.magic, buffer, pos, sizeof(caffHeader.magic))) {
-            printf("Failed to read magic in CAFF header.\n");
+        if (!readField(reader, caffHeader.magic, pos, sizeof(caffHeader.magic))) {
             return false;
         }
 
         if (caffHeader.magic[0] != 'C' || caffHeader.magic[1] != 'A' || caffHeader.magic[2] != 'F' ||
             caffHeader.magic[3] != 'F') {
-            printf("Invalid magic in CAFF header.\n");
-            return false;
+            return fail(ErrorCode::INVALID_MAGIC, startingPos);
         }
 
-        if (!datacopy(&caffHeader.header_size, buffer, pos, sizeof(caffHeader.header_size))) {
-            printf("Failed to read header_size in CAFF header.\n");
+        if (!readField(reader, &caffHeader.header_size, pos, sizeof(caffHeader.header_size))) {
             return false;
         }
 
         if (caffHeader.header_size !=
             sizeof(caffHeader.magic) + sizeof(caffHeader.header_size) + sizeof(caffHeader.num_anim)) {
-            printf("Invalid header_size in CAFF header.\n");
-            return false;
+            return fail(ErrorCode::INVALID_HEADER_SIZE, pos - sizeof(caffHeader.header_size));
         }
 
         if (blockLength != caffHeader.header_size) {
-            printf("CAFF header block length differs from header_size.\n");
-            return false;
+            return fail(ErrorCode::INVALID_BLOCK_LENGTH, startingPos);
         }
 
-        if (!datacopy(&caffHeader.num_anim, buffer, pos, sizeof(caffHeader.num_anim))) {
-            printf("Failed to read num_anim in CAFF header.\n");
+        if (!readField(reader, &caffHeader.num_anim, pos, sizeof(caffHeader.num_anim))) {
             return false;
         }
 
         pos = startingPos;
 
-        if (!datacopy(nullptr, buffer, pos, blockLength)) {
-            printf("Unexpected error while parsing CAFF header.\n");
-            return false;
-        }
-
-        return true;
+        return readField(reader, nullptr, pos, blockLength);
     }
 
-    bool parseCaffCredits(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_CREDITS &caffCredits) {
-        uint64_t startingPos = pos;
-
-        if (!datacopy(&caffCredits.year, buffer, pos, sizeof(caffCredits.year))) {
-            printf("Failed to read year in CAFF credits.\n");
-            return false;
-        }
-
-        if (!datacopy(&caffCredits.month, buffer, pos, sizeof(caffCredits.month))) {
-            printf("Failed to read month in CAFF credits.\n");
-            return false;
-        }
+    bool parseCaffHeader(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_HEADER &caffHeader) {
+        SpanReader reader(buffer);
+        return readCaffHeader(reader, blockLength, pos, caffHeader);
+    }
 
-        if (!datacopy(&caffCredits.day, buffer, pos, sizeof(caffCredits.day))) {
-            printf("Failed to read day in CAFF credits.\n");
-            return false;
-        }
+    bool parseCaffHeader(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_HEADER &caffHeader) {
+        return parseCaffHeader(ByteSpan(buffer), blockLength, pos, caffHeader);
+    }
 
-        if (!datacopy(&caffCredits.hour, buffer, pos, sizeof(caffCredits.hour))) {
-            printf("Failed to read hour in CAFF credits.\n");
-            return false;
-        }
+    // The creator is only checked, not read, unless readCreator is set.
+    template<typename Reader>
+    static bool readCaffCredits(Reader &reader, uint64_t blockLength, uint64_t &pos, CAFF_CREDITS &caffCredits, bool readCreator) {
+        uint64_t startingPos = pos;
 
-        if (!datacopy(&caffCredits.minute, buffer, pos, sizeof(caffCredits.minute))) {
-            printf("Failed to read minute in CAFF credits.\n");
+        if (!readField(reader, &caffCredits.year, pos, sizeof(caffCredits.year)) ||
+            !readField(reader, &caffCredits.month, pos, sizeof(caffCredits.month)) ||
+            !readField(reader, &caffCredits.day, pos, sizeof(caffCredits.day)) ||
+            !readField(reader, &caffCredits.hour, pos, sizeof(caffCredits.hour)) ||
+            !readField(reader, &caffCredits.minute, pos, sizeof(caffCredits.minute))) {
             return false;
         }
 
         uint64_t creator_len;
 
-        if (!datacopy(&creator_len, buffer, pos, sizeof(creator_len))) {
-            printf("Failed to read creator_len in CAFF credits.\n");
+        if (!readField(reader, &creator_len, pos, sizeof(creator_len))) {
             return false;
         }
 
@@ -192,168 +408,562 @@ namespace parser {
                                         sizeof(creator_len);
 
         if (creator_len > UINT64_MAX - caffCreditsFixedPartSize) {
-            printf("Invalid creator_len in CAFF credits (too large).\n");
-            return false;
+            return fail(ErrorCode::INVALID_CREATOR_LENGTH, pos - sizeof(creator_len));
         }
 
         if (caffCreditsFixedPartSize + creator_len != blockLength) {
-            printf("CAFF credits block length differs from the size of its content.\n");
-            return false;
+            return fail(ErrorCode::INVALID_BLOCK_LENGTH, startingPos);
         }
 
         if (creator_len > SIZE_MAX - 1) {
-            printf("Invalid creator_len in CAFF credits (too large).\n");
-            return false;
+            return fail(ErrorCode::INVALID_CREATOR_LENGTH, pos - sizeof(creator_len));
         }
 
-        caffCredits.creator.resize(creator_len + 1);
-
-        if (!datacopy((void *) caffCredits.creator.data(), buffer, pos, creator_len)) {
-            printf("Failed to read creator in CAFF credits.\n");
-            return false;
+        // Checked before allocating, so a bogus length cannot ask for more memory than the input holds.
+        if (creator_len > reader.size() - pos) {
+            return fail(ErrorCode::TRUNCATED, pos);
         }
 
-        caffCredits.creator[creator_len] = '\0';
+        if (readCreator) {
+            caffCredits.creator.resize(creator_len + 1);
 
-        pos = startingPos;
+            if (!readField(reader, (void *) caffCredits.creator.data(), pos, creator_len)) {
+                return false;
+            }
 
-        if (!datacopy(nullptr, buffer, pos, blockLength)) {
-            printf("Unexpected error while parsing CAFF credits.\n");
-            return false;
+            caffCredits.creator[creator_len] = '\0';
         }
 
-        return true;
+        pos = startingPos;
+
+        return readField(reader, nullptr, pos, blockLength);
     }
 
-    bool parseCaffAnimation(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION &caffAnimation) {
+    bool parseCaffCredits(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_CREDITS &caffCredits) {
+        SpanReader reader(buffer);
+        return readCaffCredits(reader, blockLength, pos, caffCredits, true);
+    }
+
+    bool parseCaffCredits(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_CREDITS &caffCredits) {
+        return parseCaffCredits(ByteSpan(buffer), blockLength, pos, caffCredits);
+    }
+
+    // An animation block without the pixel hash and without counting it. The block must hold exactly the duration and
+    // the CIFF, otherwise the next block would be read from inside this one.
+    template<typename Reader>
+    static bool readCaffAnimation(Reader &reader, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION_VIEW &caffAnimation) {
         uint64_t startingPos = pos;
+        caffAnimation.pixel_hash = 0;
 
-        if (!datacopy(&caffAnimation.duration, buffer, pos, sizeof(caffAnimation.duration))) {
-            printf("Failed to read duration in CAFF animation.\n");
+        if (!readField(reader, &caffAnimation.duration, pos, sizeof(caffAnimation.duration))) {
             return false;
         }
 
-        if (!parseCiff(buffer, pos, caffAnimation.ciff)) {
-            printf("Failed to parse CIFF in CAFF animation.\n");
+        if (!readCiff(reader, pos, caffAnimation.ciff)) {
             return false;
         }
 
-        pos = startingPos;
+        // The CIFF was read in full, so these sums cannot overflow.
+        if (blockLength != sizeof(caffAnimation.duration) + caffAnimation.ciff.header_size + caffAnimation.ciff.content_size) {
+            return fail(ErrorCode::INVALID_BLOCK_LENGTH, startingPos);
+        }
 
-        if (!datacopy(nullptr, buffer, pos, blockLength)) {
-            printf("Unexpected error while parsing CAFF animation.\n");
+        return true;
+    }
+
+    // parseCaffAnimation() without the pixel hash, for callers that do not look at the pixels.
+    static bool parseCaffAnimationBlock(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION_VIEW &caffAnimation) {
+        SpanReader reader(buffer);
+
+        if (!readCaffAnimation(reader, blockLength, pos, caffAnimation)) {
             return false;
         }
 
+        STATS_COUNT(BYTES_PARSED, caffAnimation.ciff.header_size + caffAnimation.ciff.content_size);
+        STATS_COUNT(FRAMES, 1);
         return true;
     }
 
-    bool parseCaffFile(std::string filePath, CAFF &caff) {
-        std::ifstream file;
-        file.open(filePath, std::ifstream::in | std::ifstream::binary);
+    static void hashFrame(CAFF_ANIMATION_VIEW &caffAnimation) {
+        STATS_TIMER(PIXEL_HASH);
+        caffAnimation.pixel_hash = hashPixels(caffAnimation.ciff.pixels, caffAnimation.ciff.content_size);
+    }
 
-        if (!file) {
-            printf("Failed to open CAFF file.\n");
+    bool parseCaffAnimation(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION_VIEW &caffAnimation) {
+        if (!parseCaffAnimationBlock(buffer, blockLength, pos, caffAnimation)) {
             return false;
         }
 
-        std::vector<char> buffer(std::istreambuf_iterator<char>(file), {});
+        hashFrame(caffAnimation);
+
+        return true;
+    }
+
+    bool parseCaffAnimation(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION &caffAnimation) {
+        CAFF_ANIMATION_VIEW view;
+
+        if (!parseCaffAnimation(buffer, blockLength, pos, view)) {
+            return false;
+        }
+
+        caffAnimation.duration = view.duration;
+        caffAnimation.pixel_hash = view.pixel_hash;
+        caffAnimation.same_as = UNKNOWN_FRAME;
+        copyCiff(view.ciff, caffAnimation.ciff);
+
+        return true;
+    }
 
-        file.close();
+    bool parseCaffAnimation(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION &caffAnimation) {
+        return parseCaffAnimation(ByteSpan(buffer), blockLength, pos, caffAnimation);
+    }
 
+    // Walks the block structure of a CAFF and hands every animation block to
+    // onAnimation(blockOffset, blockLength, animation), where blockOffset is the position of the block ID. This holds
+    // all checks of the CAFF block sequence for both the parsers and the validators. The creator is only read if
+    // readCreator is set.
+    template<typename Reader, typename OnAnimation>
+    static bool walkCaffBlocks(Reader &reader, CAFF_HEADER &header, CAFF_CREDITS &credits, bool readCreator, OnAnimation onAnimation) {
         uint64_t pos = 0;
 
         uint8_t id;
         uint64_t blockLength;
 
-        if (!datacopy(&id, buffer, pos, sizeof(id))) {
-            printf("Failed to read first block ID in CAFF file.\n");
-            return false;
-        }
-
-        if (!datacopy(&blockLength, buffer, pos, sizeof(blockLength))) {
-            printf("Failed to read first block length in CAFF file.\n");
+        if (!readField(reader, &id, pos, sizeof(id)) || !readField(reader, &blockLength, pos, sizeof(blockLength))) {
             return false;
         }
 
         if (id != 0x1) {
-            printf("Invalid first block ID in CAFF file (must be 0x1).\n");
-            return false;
+            return fail(ErrorCode::INVALID_BLOCK_ID, 0);
         }
 
-        if (!parseCaffHeader(buffer, blockLength, pos, caff.header)) {
-            printf("Failed to parse CAFF header in CAFF file.\n");
+        if (!readCaffHeader(reader, blockLength, pos, header)) {
             return false;
         }
 
-        if (!datacopy(&id, buffer, pos, sizeof(id))) {
-            printf("Failed to read second block ID in CAFF file.\n");
-            return false;
-        }
+        uint64_t block = 1;
 
-        if (!datacopy(&blockLength, buffer, pos, sizeof(blockLength))) {
-            printf("Failed to read second block length in CAFF file.\n");
-            return false;
+        if (!readField(reader, &id, pos, sizeof(id)) || !readField(reader, &blockLength, pos, sizeof(blockLength))) {
+            return failInBlock(block);
         }
 
         if (id == 0x2) {
-            if (!parseCaffCredits(buffer, blockLength, pos, caff.credits)) {
-                printf("Failed to parse CAFF credits in CAFF file.\n");
-                return false;
+            if (!readCaffCredits(reader, blockLength, pos, credits, readCreator)) {
+                return failInBlock(block);
             }
+
+            block++;
         } else {
             pos -= sizeof(id) + sizeof(blockLength);
         }
 
-        for (uint64_t i = 0; i < caff.header.num_anim; i++) {
-            if (!datacopy(&id, buffer, pos, sizeof(id))) {
-                printf("Failed to read animation block ID in CAFF file.\n");
-                return false;
-            }
+        for (uint64_t i = 0; i < header.num_anim; i++, block++) {
+            uint64_t blockOffset = pos;
 
-            if (!datacopy(&blockLength, buffer, pos, sizeof(blockLength))) {
-                printf("Failed to read animation block length in CAFF file.\n");
-                return false;
+            if (!readField(reader, &id, pos, sizeof(id)) || !readField(reader, &blockLength, pos, sizeof(blockLength))) {
+                return failInBlock(block);
             }
 
             if (id != 0x3) {
-                printf("Invalid animation block ID in CAFF file (must be 0x3).\n");
-                return false;
+                return setParseError(ErrorCode::INVALID_BLOCK_ID, blockOffset, block);
             }
 
-            CAFF_ANIMATION caffAnimation;
+            CAFF_ANIMATION_VIEW caffAnimation;
 
-            if (!parseCaffAnimation(buffer, blockLength, pos, caffAnimation)) {
-                printf("Failed to parse CAFF animation in CAFF file.\n");
-                return false;
+            if (!readCaffAnimation(reader, blockLength, pos, caffAnimation)) {
+                return failInBlock(block);
             }
 
-            caff.animations.push_back(caffAnimation);
+            if (!onAnimation(blockOffset, blockLength, caffAnimation)) {
+                return setParseError(ErrorCode::CANCELLED, blockOffset, block);
+            }
         }
 
         return true;
     }
 
-    bool parseCiffFile(std::string filePath, CIFF &ciff) {
+    // walkCaffBlocks() over a buffer, counting the frames for the statistics. Pixel hashes are only computed if
+    // hashFrames is set.
+    template<typename OnAnimation>
+    static bool parseCaffBlocks(ByteSpan buffer, CAFF_HEADER &header, CAFF_CREDITS &credits, bool hashFrames, OnAnimation onAnimation) {
+        SpanReader reader(buffer);
+
+        return walkCaffBlocks(reader, header, credits, true,
+                              [hashFrames, &onAnimation](uint64_t blockOffset, uint64_t blockLength, CAFF_ANIMATION_VIEW &caffAnimation) {
+                                  STATS_COUNT(BYTES_PARSED, caffAnimation.ciff.header_size + caffAnimation.ciff.content_size);
+                                  STATS_COUNT(FRAMES, 1);
+
+                                  if (hashFrames) {
+                                      hashFrame(caffAnimation);
+                                  }
+
+                                  return onAnimation(blockOffset, blockLength, caffAnimation);
+                              });
+    }
+
+    // Finds frames repeating an earlier one. The hash only picks the candidate, size and pixels are compared in full.
+    class FrameMatcher {
+    public:
+        // Returns the index of the first earlier frame equal to ciff, or index if there is none.
+        uint64_t match(uint64_t index, uint64_t pixelHash, const CIFF_VIEW &ciff) {
+            auto candidates = firstFrames.equal_range(pixelHash);
+
+            for (auto it = candidates.first; it != candidates.second; ++it) {
+                const CIFF_VIEW &earlier = it->second.second;
+
+                if (earlier.width == ciff.width && earlier.height == ciff.height &&
+                    std::memcmp(earlier.pixels, ciff.pixels, ciff.content_size) == 0) {
+                    return it->second.first;
+                }
+            }
+
+            firstFrames.emplace(pixelHash, std::make_pair(index, ciff));
+            return index;
+        }
+
+    private:
+        std::unordered_multimap<uint64_t, std::pair<uint64_t, CIFF_VIEW>> firstFrames;
+    };
+
+    bool parseCaff(ByteSpan buffer, CAFF_VIEW &caff) {
+        caff.animations.clear();
+        FrameMatcher matcher;
+
+        return parseCaffBlocks(buffer, caff.header, caff.credits, true,
+                               [&caff, &matcher](uint64_t, uint64_t, const CAFF_ANIMATION_VIEW &caffAnimation) {
+                                   uint64_t sameAs = matcher.match(caff.animations.size(), caffAnimation.pixel_hash, caffAnimation.ciff);
+
+                                   caff.animations.push_back(caffAnimation);
+
+                                   if (sameAs != caff.animations.size() - 1) {
+                                       caff.animations.back().ciff.pixels = caff.animations[sameAs].ciff.pixels;
+                                   }
+                                   return true;
+                               });
+    }
+
+    bool indexCaff(ByteSpan buffer, CAFF_INDEX &index) {
+        index.frames.clear();
+
+        return parseCaffBlocks(buffer, index.header, index.credits, false,
+                               [&buffer, &index](uint64_t blockOffset, uint64_t blockLength, const CAFF_ANIMATION_VIEW &caffAnimation) {
+                                   CAFF_FRAME_INDEX frame;
+
+                                   frame.offset = blockOffset;
+                                   frame.length = blockLength;
+                                   frame.duration = caffAnimation.duration;
+                                   frame.width = caffAnimation.ciff.width;
+                                   frame.height = caffAnimation.ciff.height;
+                                   frame.ciff_offset = (uint64_t) (caffAnimation.ciff.pixels - buffer.data) - caffAnimation.ciff.header_size;
+
+                                   index.frames.push_back(frame);
+                                   return true;
+                               });
+    }
+
+    bool loadCaffFrame(ByteSpan buffer, const CAFF_FRAME_INDEX &frame, CIFF_VIEW &ciff) {
+        uint64_t pos = frame.ciff_offset;
+
+        // Counted by the statistics when the frame was indexed.
+        if (!parseCiffAt(buffer, pos, ciff)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool loadCaffFrame(ByteSpan buffer, const CAFF_FRAME_INDEX &frame, CIFF &ciff) {
+        CIFF_VIEW view;
+
+        if (!loadCaffFrame(buffer, frame, view)) {
+            return false;
+        }
+
+        copyCiff(view, ciff);
+
+        return true;
+    }
+
+    // Minimum size of an animation block: block ID, block length, duration and a CIFF header without caption.
+    static const uint64_t minimumAnimationBlockSize = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint64_t) +
+                                                      sizeof(CIFF::magic) + 4 * sizeof(uint64_t);
+
+    bool parseCaff(ByteSpan buffer, CAFF &caff) {
+        caff.animations.clear();
+        FrameMatcher matcher;
+
+        return parseCaffBlocks(buffer, caff.header, caff.credits, true,
+                               [&buffer, &caff, &matcher](uint64_t blockOffset, uint64_t, const CAFF_ANIMATION_VIEW &caffAnimation) {
+                                   // num_anim is untrusted, so never reserve more frames than the remaining bytes can hold.
+                                   if (caff.animations.empty()) {
+                                       uint64_t maxFrames = (buffer.size - blockOffset) / minimumAnimationBlockSize;
+                                       caff.animations.reserve((size_t) std::min(caff.header.num_anim, maxFrames));
+                                   }
+
+                                   uint64_t index = caff.animations.size();
+                                   caff.animations.emplace_back();
+                                   CAFF_ANIMATION &animation = caff.animations.back();
+                                   animation.duration = caffAnimation.duration;
+                                   animation.pixel_hash = caffAnimation.pixel_hash;
+                                   animation.same_as = matcher.match(index, caffAnimation.pixel_hash, caffAnimation.ciff);
+
+                                   if (animation.same_as == index) {
+                                       copyCiff(caffAnimation.ciff, animation.ciff);
+                                   } else {
+                                       copyCiffHeader(caffAnimation.ciff, animation.ciff);
+                                       animation.ciff.pixels = caff.animations[animation.same_as].ciff.pixels;
+                                   }
+                                   return true;
+                               });
+    }
+
+    // Maps regular files so pixels are copied once, straight from the page cache. Anything that cannot be
+    // mapped (pipes, character devices) is read into buffer instead. Failures are recorded for parseError().
+    static bool loadFile(const std::string &filePath, MappedFile &mapped, std::vector<char> &buffer, ByteSpan &bytes) {
+        if (mapped.open(filePath)) {
+            bytes = mapped.bytes();
+            return true;
+        }
+
+        STATS_TIMER(READ_FILE);
         std::ifstream file;
         file.open(filePath, std::ifstream::in | std::ifstream::binary);
 
         if (!file) {
-            printf("Failed to open CIFF file.\n");
+            return fail(ErrorCode::OPEN_FAILED, 0);
+        }
+
+        char chunk[1 << 16];
+        buffer.clear();
+
+        while (file.read(chunk, sizeof(chunk)) || file.gcount() > 0) {
+            buffer.insert(buffer.end(), chunk, chunk + file.gcount());
+        }
+
+        // A read error would otherwise look like a document truncated wherever it happened.
+        if (file.bad()) {
+            return fail(ErrorCode::READ_FAILED, buffer.size());
+        }
+
+        bytes = ByteSpan(buffer);
+
+        return true;
+    }
+
+    bool parseCaffFile(std::string filePath, CAFF &caff) {
+        MappedFile mapped;
+        std::vector<char> buffer;
+        ByteSpan bytes;
+
+        if (!loadFile(filePath, mapped, buffer, bytes)) {
+            return false;
+        }
+
+        return parseCaff(bytes, caff);
+    }
+
+    bool parseCiffFile(std::string filePath, CIFF &ciff) {
+        MappedFile mapped;
+        std::vector<char> buffer;
+        ByteSpan bytes;
+
+        if (!loadFile(filePath, mapped, buffer, bytes)) {
+            return false;
+        }
+
+        uint64_t pos = 0;
+
+        if (!parseCiff(bytes, pos, ciff)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    MappedFile::~MappedFile() {
+        close();
+    }
+
+    bool MappedFile::open(const std::string &filePath) {
+        STATS_TIMER(READ_FILE);
+        close();
+
+        int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
             return false;
         }
 
-        std::vector<char> buffer(std::istreambuf_iterator<char>(file), {});
+        struct stat st;
 
-        file.close();
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+
+        if (st.st_size > 0) {
+            void *mapping = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+
+            mappedData = static_cast<const char *>(mapping);
+            mappedSize = (uint64_t) st.st_size;
+        }
+
+        ::close(fd);
+
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (mappedData != nullptr) {
+            munmap(const_cast<char *>(mappedData), (size_t) mappedSize);
+        }
+
+        mappedData = nullptr;
+        mappedSize = 0;
+    }
+
+    bool parseCiffFile(std::string filePath, MappedFile &file, CIFF_VIEW &ciff) {
+        if (!file.open(filePath)) {
+            return fail(ErrorCode::OPEN_FAILED, 0);
+        }
 
         uint64_t pos = 0;
 
-        if (!parseCiff(buffer, pos, ciff)) {
-            printf("Failed to parse CIFF file content.\n");
+        if (!parseCiff(file.bytes(), pos, ciff)) {
             return false;
         }
 
         return true;
     }
+
+    bool parseCaffFile(std::string filePath, MappedFile &file, CAFF_VIEW &caff) {
+        if (!file.open(filePath)) {
+            return fail(ErrorCode::OPEN_FAILED, 0);
+        }
+
+        return parseCaff(file.bytes(), caff);
+    }
+
+    bool indexCaffFile(std::string filePath, MappedFile &file, CAFF_INDEX &index) {
+        if (!file.open(filePath)) {
+            return fail(ErrorCode::OPEN_FAILED, 0);
+        }
+
+        return indexCaff(file.bytes(), index);
+    }
+
+    const char *errorMessage(ErrorCode error) {
+        switch (error) {
+            case ErrorCode::NONE:
+                return "No error";
+            case ErrorCode::OPEN_FAILED:
+                return "Failed to open file";
+            case ErrorCode::READ_FAILED:
+                return "Failed to read file";
+            case ErrorCode::TRUNCATED:
+                return "Unexpected end of data";
+            case ErrorCode::INVALID_BLOCK_ID:
+                return "Invalid block ID";
+            case ErrorCode::INVALID_MAGIC:
+                return "Invalid magic";
+            case ErrorCode::INVALID_HEADER_SIZE:
+                return "Invalid header_size";
+            case ErrorCode::INVALID_BLOCK_LENGTH:
+                return "Block length differs from the size of its content";
+            case ErrorCode::INVALID_CONTENT_SIZE:
+                return "Invalid CIFF content_size";
+            case ErrorCode::INVALID_CREATOR_LENGTH:
+                return "Invalid creator_len in CAFF credits";
+            case ErrorCode::CANCELLED:
+                return "Parsing cancelled";
+        }
+
+        return "Unknown error";
+    }
+
+    template<typename Reader>
+    static bool validateCiffData(Reader &reader, VALIDATION &result) {
+        uint64_t pos = 0;
+        CIFF_VIEW ciff;
+
+        if (!readCiff(reader, pos, ciff)) {
+            return false;
+        }
+
+        result.width = ciff.width;
+        result.height = ciff.height;
+        return true;
+    }
+
+    template<typename Reader>
+    static bool validateCaffData(Reader &reader, VALIDATION &result) {
+        CAFF_HEADER header;
+        CAFF_CREDITS credits;
+
+        return walkCaffBlocks(reader, header, credits, false,
+                              [&result](uint64_t, uint64_t, const CAFF_ANIMATION_VIEW &caffAnimation) {
+                                  if (result.frames++ == 0) {
+                                      result.width = caffAnimation.ciff.width;
+                                      result.height = caffAnimation.ciff.height;
+                                  }
+                                  return true;
+                              });
+    }
+
+    // Runs validateData(reader, result) and takes the verdict from the error it records, leaving parseError() as it was.
+    template<typename Reader, typename Validate>
+    static VALIDATION validate(Reader &reader, Validate validateData) {
+        VALIDATION result = VALIDATION{PARSE_ERROR{ErrorCode::NONE, 0, 0}, 0, 0, 0};
+        const PARSE_ERROR previous = lastError;
+
+        if (!validateData(reader, result)) {
+            result.error = lastError;
+        }
+
+        lastError = previous;
+        return result;
+    }
+
+    VALIDATION validateCaff(ByteSpan buffer) {
+        SpanReader reader(buffer);
+        return validate(reader, validateCaffData<SpanReader>);
+    }
+
+    VALIDATION validateCiff(ByteSpan buffer) {
+        SpanReader reader(buffer);
+        return validate(reader, validateCiffData<SpanReader>);
+    }
+
+    template<typename Validate>
+    static VALIDATION validateFile(const std::string &filePath, Validate validateData) {
+        int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        VALIDATION result;
+
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            result = VALIDATION{PARSE_ERROR{ErrorCode::OPEN_FAILED, 0, 0}, 0, 0, 0};
+        } else {
+            WindowReader reader(fd, (uint64_t) st.st_size);
+            result = validate(reader, validateData);
+        }
+
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        return result;
+    }
+
+    VALIDATION validateCaffFile(const std::string &filePath) {
+        return validateFile(filePath, validateCaffData<WindowReader>);
+    }
+
+    VALIDATION validateCiffFile(const std::string &filePath) {
+        return validateFile(filePath, validateCiffData<WindowReader>);
+    }
 }
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <cstdint>
+#include <memory>
 #include <string>
 
 namespace parser {
@@ -12,7 +13,8 @@ namespace parser {
         uint64_t content_size;
         uint64_t width;
         uint64_t height;
-        std::vector<char> pixels;
+        // Always content_size bytes once parsed. Frames of a CAFF that repeat an earlier frame share its buffer.
+        std::shared_ptr<const std::vector<char>> pixels;
     };
 
     struct CAFF_HEADER {
@@ -30,8 +32,16 @@ namespace parser {
         std::string creator;
     };
 
+    // Value of CAFF_ANIMATION::same_as for a frame parsed on its own, whose place in the animation is not known.
+    static const uint64_t UNKNOWN_FRAME = UINT64_MAX;
+
+    // pixel_hash is hashPixels() of ciff.pixels. parseCaff() stores the pixels of repeated frames only once: a frame
+    // whose size and pixels equal those of an earlier one gets that frame's index in same_as and shares its pixels.
+    // Unique frames have same_as set to their own index; parseCaffAnimation() on its own sets it to UNKNOWN_FRAME.
     struct CAFF_ANIMATION {
         uint64_t duration;
+        uint64_t pixel_hash;
+        uint64_t same_as;
         CIFF ciff;
     };
 
@@ -41,19 +51,185 @@ namespace parser {
         std::vector<CAFF_ANIMATION> animations;
     };
 
+    // Non-owning view of caller-owned bytes, e.g. a request body or a shared-memory segment.
+    struct ByteSpan {
+        ByteSpan() : data(nullptr), size(0) {}
+        ByteSpan(const char *data, uint64_t size) : data(data), size(size) {}
+        explicit ByteSpan(const std::vector<char> &buffer) : data(buffer.data()), size(buffer.size()) {}
+
+        const char *data;
+        uint64_t size;
+    };
+
+    // Non-owning variants: pixels point into the parsed buffer (e.g. a MappedFile) and stay valid only as long as it does.
+    struct CIFF_VIEW {
+        char magic[4];
+        uint64_t header_size;
+        uint64_t content_size;
+        uint64_t width;
+        uint64_t height;
+        const char *pixels;
+    };
+
+    // In a CAFF_VIEW, repeated frames share the pixels pointer of their first occurrence.
+    struct CAFF_ANIMATION_VIEW {
+        uint64_t duration;
+        uint64_t pixel_hash;
+        CIFF_VIEW ciff;
+    };
+
+    struct CAFF_VIEW {
+        CAFF_HEADER header;
+        CAFF_CREDITS credits;
+        std::vector<CAFF_ANIMATION_VIEW> animations;
+    };
+
+    // Location and metadata of one animation block. offset points at the block ID, ciff_offset at the CIFF magic.
+    struct CAFF_FRAME_INDEX {
+        uint64_t offset;
+        uint64_t length;
+        uint64_t duration;
+        uint64_t width;
+        uint64_t height;
+        uint64_t ciff_offset;
+    };
+
+    struct CAFF_INDEX {
+        CAFF_HEADER header;
+        CAFF_CREDITS credits;
+        std::vector<CAFF_FRAME_INDEX> frames;
+    };
+
+    // Which check a CAFF or CIFF failed.
+    enum class ErrorCode : uint8_t {
+        NONE,
+        OPEN_FAILED,            // The file could not be opened (as a regular file, for the validators).
+        READ_FAILED,
+        TRUNCATED,              // A field or block extends past the end of the data.
+        INVALID_BLOCK_ID,
+        INVALID_MAGIC,
+        INVALID_HEADER_SIZE,
+        INVALID_BLOCK_LENGTH,   // A block length disagrees with the block's content.
+        INVALID_CONTENT_SIZE,   // content_size is not width * height * 3, or an image side is 0.
+        INVALID_CREATOR_LENGTH,
+        CANCELLED               // A callback stopped parsing.
+    };
+
+    // Human-readable description of an error code.
+    const char *errorMessage(ErrorCode error);
+
+    // Where parsing failed. offset is the position of the offending field in the parsed buffer (for
+    // INVALID_BLOCK_LENGTH, of the block content), and block the index of the block holding it, counting the CAFF
+    // header as block 0. Functions given a single block or CIFF leave block at 0.
+    struct PARSE_ERROR {
+        ErrorCode code;
+        uint64_t offset;
+        uint64_t block;
+    };
+
+    // The parsing functions below do not print anything. When one returns false, parseError() describes the failure
+    // until the next failure on the same thread, like errno.
+    const PARSE_ERROR &parseError();
+
+    // Records a failure for parseError(), for parsers built on top of these functions. Always returns false.
+    bool setParseError(ErrorCode code, uint64_t offset, uint64_t block = 0);
+
+    // Verdict of validateCaff() / validateCiff(): the error parseCaff() / parseCiff() would report, the number of
+    // animation blocks found valid, and the size of the first image.
+    struct VALIDATION {
+        PARSE_ERROR error;
+        uint64_t frames;
+        uint64_t width;
+        uint64_t height;
+
+        bool valid() const { return error.code == ErrorCode::NONE; }
+    };
+
+    // Read-only memory mapping of a whole file.
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        bool open(const std::string &filePath);
+        void close();
+
+        const char *data() const { return mappedData; }
+        uint64_t size() const { return mappedSize; }
+        ByteSpan bytes() const { return ByteSpan(mappedData, mappedSize); }
+
+    private:
+        const char *mappedData = nullptr;
+        uint64_t mappedSize = 0;
+    };
+
+    // 64-bit content hash (the XXH64 algorithm, seed 0). Four independent lanes consume 32 bytes per step, so the
+    // loop runs at memory speed rather than being bound by multiply latency.
+    uint64_t hashPixels(const char *data, uint64_t size);
+
     bool datacopy(void *to, const std::vector<char> &from, uint64_t &pos, uint64_t count);
 
+    bool datacopy(void *to, ByteSpan from, uint64_t &pos, uint64_t count);
+
     bool parseCiff(const std::vector<char> &buffer, uint64_t &pos, CIFF &ciff);
 
+    bool parseCiff(ByteSpan buffer, uint64_t &pos, CIFF &ciff);
+
+    bool parseCiff(ByteSpan buffer, uint64_t &pos, CIFF_VIEW &ciff);
+
     bool parseCaffHeader(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_HEADER &caffHeader);
 
+    bool parseCaffHeader(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_HEADER &caffHeader);
+
     bool parseCaffCredits(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_CREDITS &caffCredits);
 
+    bool parseCaffCredits(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_CREDITS &caffCredits);
+
     bool parseCaffAnimation(const std::vector<char> &buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION &caffAnimation);
 
+    bool parseCaffAnimation(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION &caffAnimation);
+
+    // Also fills in pixel_hash, which takes one pass over the pixels.
+    bool parseCaffAnimation(ByteSpan buffer, uint64_t blockLength, uint64_t &pos, CAFF_ANIMATION_VIEW &caffAnimation);
+
+    // Parses a complete CAFF held in buffer. The view overload does not copy pixels.
+    bool parseCaff(ByteSpan buffer, CAFF &caff);
+
+    bool parseCaff(ByteSpan buffer, CAFF_VIEW &caff);
+
+    // Validates the block framing and records where each frame lives without touching any pixel data.
+    bool indexCaff(ByteSpan buffer, CAFF_INDEX &index);
+
+    // Materializes a single indexed frame from the buffer the index was built from.
+    bool loadCaffFrame(ByteSpan buffer, const CAFF_FRAME_INDEX &frame, CIFF &ciff);
+
+    bool loadCaffFrame(ByteSpan buffer, const CAFF_FRAME_INDEX &frame, CIFF_VIEW &ciff);
+
     bool parseCiffFile(std::string filePath, CIFF &ciff);
 
     bool parseCaffFile(std::string filePath, CAFF &caff);
+
+    // Maps the file and parses it in place. The views reference file's mapping.
+    bool parseCiffFile(std::string filePath, MappedFile &file, CIFF_VIEW &ciff);
+
+    bool parseCaffFile(std::string filePath, MappedFile &file, CAFF_VIEW &caff);
+
+    // Only the pages holding block and CIFF headers are faulted in; pixels are read by loadCaffFrame on demand.
+    bool indexCaffFile(std::string filePath, MappedFile &file, CAFF_INDEX &index);
+
+    // Accept or reject without parsing: runs exactly the checks of parseCaff() / parseCiff() on the block and CIFF
+    // headers alone, skipping over pixels and captions. The file variants read just the header bytes with pread(),
+    // so the cost depends on the number of blocks, not on the file size.
+    VALIDATION validateCaff(ByteSpan buffer);
+
+    VALIDATION validateCiff(ByteSpan buffer);
+
+    VALIDATION validateCaffFile(const std::string &filePath);
+
+    VALIDATION validateCiffFile(const std::string &filePath);
 }
 
 #endif //PARSER_PARSER_H
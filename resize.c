@@ -0,0 +1,257 @@
+#include "resize.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace converter {
+    // Triangle filter weights are fixed point numbers with this many fractional bits.
+    static const int weightBits = 14;
+    // Vertically filtered values keep this many fractional bits, small enough for the horizontal pass to fit in 32 bits.
+    static const int columnBits = 6;
+
+    void fitWithin(uint32_t width, uint32_t height, uint32_t maxWidth, uint32_t maxHeight, uint32_t &fittedWidth, uint32_t &fittedHeight) {
+        fittedWidth = width;
+        fittedHeight = height;
+
+        if (maxWidth != 0 && fittedWidth > maxWidth) {
+            fittedHeight = (uint32_t) std::max<uint64_t>(((uint64_t) fittedHeight * maxWidth + width / 2) / width, 1);
+            fittedWidth = maxWidth;
+        }
+
+        if (maxHeight != 0 && fittedHeight > maxHeight) {
+            fittedWidth = (uint32_t) std::max<uint64_t>(((uint64_t) width * maxHeight + height / 2) / height, 1);
+            fittedHeight = maxHeight;
+        }
+    }
+
+    // sums[i] += row[i]
+    static void addRow(uint32_t *sums, const uint8_t *row, size_t count) {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; i + 16 <= count; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            __m128i *s = reinterpret_cast<__m128i *>(sums + i);
+
+            _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(low, zero)));
+            _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(low, zero)));
+            _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(high, zero)));
+            _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(high, zero)));
+        }
+#endif
+        for (; i < count; i++) {
+            sums[i] += row[i];
+        }
+    }
+
+    // columns[i] += weightA * rowA[i] + weightB * rowB[i]
+    static void addWeightedRows(int32_t *columns, const uint8_t *rowA, const uint8_t *rowB, int16_t weightA, int16_t weightB, size_t count) {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        // Pixels of both rows are interleaved so that one madd gives weightA * a + weightB * b.
+        const __m128i pair = _mm_set1_epi32((int) ((uint32_t) (uint16_t) weightA | ((uint32_t) (uint16_t) weightB << 16)));
+
+        for (; i + 16 <= count; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rowA + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rowB + i));
+            __m128i low = _mm_unpacklo_epi8(a, b);
+            __m128i high = _mm_unpackhi_epi8(a, b);
+            __m128i *c = reinterpret_cast<__m128i *>(columns + i);
+
+            _mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), pair)));
+            _mm_storeu_si128(c + 1, _mm_add_epi32(_mm_loadu_si128(c + 1), _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), pair)));
+            _mm_storeu_si128(c + 2, _mm_add_epi32(_mm_loadu_si128(c + 2), _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), pair)));
+            _mm_storeu_si128(c + 3, _mm_add_epi32(_mm_loadu_si128(c + 3), _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), pair)));
+        }
+#endif
+        for (; i < count; i++) {
+            columns[i] += weightA * rowA[i] + weightB * rowB[i];
+        }
+    }
+
+    // When shrinking, the triangle is widened to the scale factor so every source sample contributes; when enlarging
+    // this is linear interpolation.
+    void Resizer::triangleTaps(uint32_t source, uint32_t target, std::vector<Taps> &taps, std::vector<int16_t> &weights) {
+        const double scale = (double) source / target;
+        const double support = std::max(scale, 1.0);
+        std::vector<double> raw;
+        std::vector<int32_t> quantized;
+
+        for (uint32_t i = 0; i < target; i++) {
+            const double center = (i + 0.5) * scale - 0.5;
+            const int64_t first = std::max<int64_t>((int64_t) std::floor(center - support) + 1, 0);
+            const int64_t last = std::min<int64_t>((int64_t) std::ceil(center + support) - 1, (int64_t) source - 1);
+            double total = 0;
+
+            raw.clear();
+            for (int64_t j = first; j <= last; j++) {
+                raw.push_back(std::max(1.0 - std::fabs((double) j - center) / support, 0.0));
+                total += raw.back();
+            }
+
+            // Quantized so the weights add up to exactly one, the rounding error going to the largest weight.
+            quantized.clear();
+            int32_t sum = 0;
+            size_t largest = 0;
+
+            for (size_t k = 0; k < raw.size(); k++) {
+                quantized.push_back(total > 0 ? (int32_t) std::lround(raw[k] / total * (1 << weightBits)) : 0);
+                sum += quantized[k];
+                largest = quantized[k] > quantized[largest] ? k : largest;
+            }
+
+            if (quantized.empty()) {
+                quantized.push_back(0);
+            }
+            quantized[largest] += (1 << weightBits) - sum;
+
+            // Zero weights at either end do not need to be visited.
+            size_t begin = 0;
+            size_t end = quantized.size();
+            while (begin + 1 < end && quantized[begin] == 0) {
+                begin++;
+            }
+            while (end - 1 > begin && quantized[end - 1] == 0) {
+                end--;
+            }
+
+            taps.push_back(Taps{(uint32_t) std::min<int64_t>(first + (int64_t) begin, (int64_t) source - 1), (uint32_t) (end - begin), weights.size()});
+
+            for (size_t k = begin; k < end; k++) {
+                weights.push_back((int16_t) std::max(quantized[k], (int32_t) INT16_MIN));
+            }
+        }
+    }
+
+    bool Resizer::init(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t resizedWidth, uint32_t resizedHeight) {
+        if (width == 0 || height == 0 || resizedWidth == 0 || resizedHeight == 0 ||
+            (uint64_t) width * 3 > INT_MAX || (uint64_t) resizedWidth * 3 > INT_MAX) {
+            return false;
+        }
+
+        this->pixels = pixels;
+        this->stride = (size_t) width * 3;
+        this->width = width;
+        this->height = height;
+        this->resizedWidth = resizedWidth;
+        this->resizedHeight = resizedHeight;
+
+        output.resize((size_t) resizedWidth * 3);
+
+        // The box filter sums whole blocks in 32 bits, so blocks are limited to what cannot overflow.
+        box = width % resizedWidth == 0 && height % resizedHeight == 0 &&
+              (uint64_t) (width / resizedWidth) * (height / resizedHeight) <= UINT32_MAX / 256;
+
+        if (box) {
+            factorX = width / resizedWidth;
+            factorY = height / resizedHeight;
+            sums.resize(stride);
+            return true;
+        }
+
+        horizontalTaps.clear();
+        verticalTaps.clear();
+        weights.clear();
+        triangleTaps(width, resizedWidth, horizontalTaps, weights);
+        triangleTaps(height, resizedHeight, verticalTaps, weights);
+        columns.resize(stride);
+        return true;
+    }
+
+    const uint8_t *Resizer::row(uint32_t y) {
+        return box ? boxRow(y) : triangleRow(y);
+    }
+
+    const uint8_t *Resizer::boxRow(uint32_t y) {
+        const uint8_t *first = pixels + (size_t) y * factorY * stride;
+
+        if (factorX == 1 && factorY == 1) {
+            return first;
+        }
+
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (uint32_t r = 0; r < factorY; r++) {
+            addRow(sums.data(), first + r * stride, stride);
+        }
+
+        const uint32_t area = factorX * factorY;
+
+        for (size_t x = 0; x < resizedWidth; x++) {
+            for (size_t c = 0; c < 3; c++) {
+                uint32_t sum = 0;
+
+                for (size_t k = 0; k < factorX; k++) {
+                    sum += sums[(x * factorX + k) * 3 + c];
+                }
+
+                output[x * 3 + c] = (uint8_t) ((sum + area / 2) / area);
+            }
+        }
+
+        return output.data();
+    }
+
+    const uint8_t *Resizer::triangleRow(uint32_t y) {
+        const Taps &vertical = verticalTaps[y];
+        const int16_t *w = weights.data() + vertical.weights;
+
+        std::fill(columns.begin(), columns.end(), 0);
+
+        for (uint32_t k = 0; k < vertical.count; k += 2) {
+            const uint8_t *rowA = pixels + (size_t) (vertical.first + k) * stride;
+            const bool paired = k + 1 < vertical.count;
+            addWeightedRows(columns.data(), rowA, paired ? rowA + stride : rowA, w[k], paired ? w[k + 1] : 0, stride);
+        }
+
+        const int columnShift = weightBits - columnBits;
+        const int outputShift = weightBits + columnBits;
+
+        for (size_t x = 0; x < resizedWidth; x++) {
+            const Taps &horizontal = horizontalTaps[x];
+            const int16_t *hw = weights.data() + horizontal.weights;
+            const int32_t *column = columns.data() + (size_t) horizontal.first * 3;
+
+            for (size_t c = 0; c < 3; c++) {
+                int32_t sum = 0;
+
+                for (size_t k = 0; k < horizontal.count; k++) {
+                    sum += hw[k] * ((column[k * 3 + c] + (1 << (columnShift - 1))) >> columnShift);
+                }
+
+                output[x * 3 + c] = (uint8_t) std::min(std::max((sum + (1 << (outputShift - 1))) >> outputShift, 0), 255);
+            }
+        }
+
+        return output.data();
+    }
+
+    bool encodeResized(jpge::jpeg_encoder &encoder, jpge::output_stream &stream, const uint8_t *pixels, uint32_t width, uint32_t height,
+                       uint32_t resizedWidth, uint32_t resizedHeight, const jpge::params &params) {
+        Resizer resizer;
+
+        if (resizedWidth > INT_MAX || resizedHeight > INT_MAX || !resizer.init(pixels, width, height, resizedWidth, resizedHeight) ||
+            !encoder.init(&stream, (int) resizedWidth, (int) resizedHeight, 3, params)) {
+            return false;
+        }
+
+        bool success = true;
+
+        for (uint32_t y = 0; y < resizedHeight && success; y++) {
+            success = encoder.process_scanline(resizer.row(y));
+        }
+
+        success = success && encoder.process_scanline(nullptr);
+        encoder.reset();
+        return success;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef PARSER_RESIZE_H
+#define PARSER_RESIZE_H
+
+#include "jpge.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace converter {
+    // Scales width x height down to fit into maxWidth x maxHeight, keeping the aspect ratio. A limit of 0 means
+    // unlimited, and images already fitting are left as they are.
+    void fitWithin(uint32_t width, uint32_t height, uint32_t maxWidth, uint32_t maxHeight, uint32_t &fittedWidth, uint32_t &fittedHeight);
+
+    // Resizes a packed RGB image one output row at a time, so the rows can be handed to the encoder as they are made
+    // and no more than a source row's worth of intermediate data is held. When both sizes divide evenly the result is
+    // a box filter (the mean of each block of source pixels), otherwise a separable triangle filter.
+    class Resizer {
+    public:
+        bool init(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t resizedWidth, uint32_t resizedHeight);
+
+        // Returns row y of the resized image, resizedWidth * 3 bytes that stay valid until the next call.
+        const uint8_t *row(uint32_t y);
+
+    private:
+        // Source pixels contributing to one output pixel, and where their weights start in the weights vector.
+        struct Taps {
+            uint32_t first;
+            uint32_t count;
+            size_t weights;
+        };
+
+        static void triangleTaps(uint32_t source, uint32_t target, std::vector<Taps> &taps, std::vector<int16_t> &weights);
+
+        const uint8_t *boxRow(uint32_t y);
+        const uint8_t *triangleRow(uint32_t y);
+
+        const uint8_t *pixels = nullptr;
+        size_t stride = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t resizedWidth = 0;
+        uint32_t resizedHeight = 0;
+
+        bool box = false;
+        uint32_t factorX = 1;
+        uint32_t factorY = 1;
+        std::vector<uint32_t> sums;
+
+        std::vector<Taps> horizontalTaps;
+        std::vector<Taps> verticalTaps;
+        std::vector<int16_t> weights;
+        std::vector<int32_t> columns;
+
+        std::vector<uint8_t> output;
+    };
+
+    // Encodes the pixels resized to resizedWidth x resizedHeight. Rows are resized just before the encoder needs them.
+    bool encodeResized(jpge::jpeg_encoder &encoder, jpge::output_stream &stream, const uint8_t *pixels, uint32_t width, uint32_t height,
+                       uint32_t resizedWidth, uint32_t resizedHeight, const jpge::params &params);
+}
+
+#endif //PARSER_RESIZE_H
@@ -0,0 +1,194 @@
+#include "sha256.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86
+#endif
+
+namespace sha256 {
+    static const uint32_t roundConstants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    static inline uint32_t rotr32(uint32_t value, int bits) {
+        return (value >> bits) | (value << (32 - bits));
+    }
+
+    static void compressScalar(uint32_t state[8], const uint8_t *data, size_t blocks) {
+        for (; blocks > 0; blocks--, data += 64) {
+            uint32_t w[64];
+
+            for (int i = 0; i < 16; i++) {
+                w[i] = (uint32_t) data[i * 4] << 24 | (uint32_t) data[i * 4 + 1] << 16 | (uint32_t) data[i * 4 + 2] << 8 |
+                       (uint32_t) data[i * 4 + 3];
+            }
+
+            for (int i = 16; i < 64; i++) {
+                uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+            for (int i = 0; i < 64; i++) {
+                uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + roundConstants[i] + w[i];
+                uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+    }
+
+#ifdef SHA256_X86
+    // The SHA extensions keep the state as ABEF and CDGH and run four rounds per pair of sha256rnds2. Message words
+    // are extended four at a time, msg1 starting one group and msg2 finishing it three groups later.
+    __attribute__((target("sha,sse4.1"))) static void compressSha(uint32_t state[8], const uint8_t *data, size_t blocks) {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+        __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0])), 0xB1);
+        __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4])), 0x1B);
+        __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+        __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+        for (; blocks > 0; blocks--, data += 64) {
+            const __m128i savedAbef = abef;
+            const __m128i savedCdgh = cdgh;
+            __m128i words[4];
+
+#pragma GCC unroll 16
+            for (int group = 0; group < 16; group++) {
+                __m128i &current = words[group % 4];
+
+                if (group < 4) {
+                    current = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + group * 16)), byteSwap);
+                }
+
+                __m128i message = _mm_add_epi32(current, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&roundConstants[group * 4])));
+                cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+                abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+
+                if (group >= 3 && group <= 14) {
+                    __m128i &next = words[(group + 1) % 4];
+                    next = _mm_add_epi32(next, _mm_alignr_epi8(current, words[(group + 3) % 4], 4));
+                    next = _mm_sha256msg2_epu32(next, current);
+                }
+
+                if (group >= 1 && group <= 12) {
+                    __m128i &previous = words[(group + 3) % 4];
+                    previous = _mm_sha256msg1_epu32(previous, current);
+                }
+            }
+
+            abef = _mm_add_epi32(abef, savedAbef);
+            cdgh = _mm_add_epi32(cdgh, savedCdgh);
+        }
+
+        __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+        __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), _mm_blend_epi16(feba, dchg, 0xF0));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), _mm_alignr_epi8(dchg, feba, 8));
+    }
+#endif
+
+    typedef void (*CompressFunction)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+    // Picked once for the running CPU.
+    static CompressFunction selectCompress() {
+#ifdef SHA256_X86
+        unsigned int eax, ebx, ecx, edx;
+        __builtin_cpu_init();
+
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1")) {
+            return compressSha;
+        }
+#endif
+        return compressScalar;
+    }
+
+    static const CompressFunction compress = selectCompress();
+
+    Hasher::Hasher() : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+    void Hasher::update(const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        length += size;
+
+        if (buffered > 0) {
+            size_t taken = size < sizeof(buffer) - buffered ? size : sizeof(buffer) - buffered;
+            std::memcpy(buffer + buffered, bytes, taken);
+            buffered += taken;
+            bytes += taken;
+            size -= taken;
+
+            if (buffered < sizeof(buffer)) {
+                return;
+            }
+
+            compress(state, buffer, 1);
+            buffered = 0;
+        }
+
+        if (size >= sizeof(buffer)) {
+            compress(state, bytes, size / sizeof(buffer));
+            bytes += size - size % sizeof(buffer);
+            size %= sizeof(buffer);
+        }
+
+        if (size > 0) {
+            std::memcpy(buffer, bytes, size);
+        }
+
+        buffered = size;
+    }
+
+    void Hasher::finish(uint8_t digest[digestSize]) {
+        const uint64_t bits = length * 8;
+        const uint8_t padding = 0x80;
+        const uint8_t zeros[64] = {};
+
+        update(&padding, 1);
+        update(zeros, buffered <= 56 ? 56 - buffered : 64 + 56 - buffered);
+
+        uint8_t lengthBytes[8];
+
+        for (int i = 0; i < 8; i++) {
+            lengthBytes[i] = (uint8_t) (bits >> (56 - i * 8));
+        }
+
+        update(lengthBytes, sizeof(lengthBytes));
+
+        for (int i = 0; i < 8; i++) {
+            digest[i * 4] = (uint8_t) (state[i] >> 24);
+            digest[i * 4 + 1] = (uint8_t) (state[i] >> 16);
+            digest[i * 4 + 2] = (uint8_t) (state[i] >> 8);
+            digest[i * 4 + 3] = (uint8_t) state[i];
+        }
+    }
+}
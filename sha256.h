@@ -0,0 +1,28 @@
+#ifndef PARSER_SHA256_H
+#define PARSER_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+
+// SHA-256 (FIPS 180-4), for keys that inputs from untrusted sources must not be able to collide on.
+namespace sha256 {
+    static const size_t digestSize = 32;
+
+    class Hasher {
+    public:
+        Hasher();
+
+        void update(const void *data, size_t size);
+
+        // Writes the digest of everything passed to update(). The hasher must not be used afterwards.
+        void finish(uint8_t digest[digestSize]);
+
+    private:
+        uint32_t state[8];
+        uint8_t buffer[64];
+        size_t buffered = 0;
+        uint64_t length = 0;
+    };
+}
+
+#endif //PARSER_SHA256_H
@@ -0,0 +1,229 @@
+#include "stats.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#if defined(PARSER_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define STATS_USE_TSC
+#endif
+
+namespace stats {
+    static const char *const stageNames[stageCount] = {
+        "read_file", "pixel_copy", "pixel_hash", "color_convert", "dct", "entropy_code", "write_output"
+    };
+
+    static const char *const counterNames[counterCount] = {
+        "bytes_parsed", "frames", "mcus", "output_bytes"
+    };
+
+    const char *stageName(Stage stage) {
+        return (size_t) stage < stageCount ? stageNames[(size_t) stage] : "unknown";
+    }
+
+    const char *counterName(Counter counter) {
+        return (size_t) counter < counterCount ? counterNames[(size_t) counter] : "unknown";
+    }
+
+#ifdef PARSER_STATS
+    namespace {
+        // Raw sums in clock ticks.
+        struct Totals {
+            uint64_t ticks[stageCount] = {};
+            uint64_t calls[stageCount] = {};
+            uint64_t counters[counterCount] = {};
+
+            void add(const ThreadStats &slots) {
+                for (size_t i = 0; i < stageCount; i++) {
+                    ticks[i] += slots.ticks[i].load(std::memory_order_relaxed);
+                    calls[i] += slots.calls[i].load(std::memory_order_relaxed);
+                }
+
+                for (size_t i = 0; i < counterCount; i++) {
+                    counters[i] += slots.counters[i].load(std::memory_order_relaxed);
+                }
+            }
+        };
+
+        struct Registry {
+            std::mutex mutex;
+            std::vector<ThreadStats *> live;
+            Totals finished;  // Left behind by threads that have exited.
+            Totals baseline;  // Everything up to the last reset().
+        };
+
+        // Never destroyed, since thread-local slots may outlive static objects at exit.
+        Registry &registry() {
+            static Registry *instance = new Registry();
+            return *instance;
+        }
+
+        Totals totals(Registry &registry) {
+            Totals result = registry.finished;
+
+            for (const ThreadStats *slots : registry.live) {
+                result.add(*slots);
+            }
+
+            return result;
+        }
+
+        uint64_t steadyNanoseconds() {
+            return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Pairs of tick and nanosecond readings, from which the tick rate follows.
+        struct Calibration {
+            uint64_t ticks;
+            uint64_t nanoseconds;
+        };
+
+        const Calibration startCalibration = {ticks(), steadyNanoseconds()};
+
+        double ticksPerNanosecond() {
+#ifdef STATS_USE_TSC
+            Calibration now = {ticks(), steadyNanoseconds()};
+
+            // Measured over the whole run, but for at least a few milliseconds so the clock granularity does not matter.
+            while (now.nanoseconds - startCalibration.nanoseconds < 5000000) {
+                now = {ticks(), steadyNanoseconds()};
+            }
+
+            return (double) (now.ticks - startCalibration.ticks) / (double) (now.nanoseconds - startCalibration.nanoseconds);
+#else
+            return 1.0;
+#endif
+        }
+    }
+
+    ThreadStats::ThreadStats() {
+        for (size_t i = 0; i < stageCount; i++) {
+            ticks[i] = 0;
+            calls[i] = 0;
+        }
+
+        for (size_t i = 0; i < counterCount; i++) {
+            counters[i] = 0;
+        }
+
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        registry().live.push_back(this);
+    }
+
+    ThreadStats::~ThreadStats() {
+        Registry &shared = registry();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.finished.add(*this);
+
+        for (size_t i = 0; i < shared.live.size(); i++) {
+            if (shared.live[i] == this) {
+                shared.live.erase(shared.live.begin() + (ptrdiff_t) i);
+                break;
+            }
+        }
+    }
+
+    ThreadStats &threadStats() {
+        static thread_local ThreadStats slots;
+        return slots;
+    }
+
+    uint64_t ticks() {
+#ifdef STATS_USE_TSC
+        return __rdtsc();
+#else
+        return steadyNanoseconds();
+#endif
+    }
+
+    Snapshot snapshot() {
+        Totals current;
+        Totals baseline;
+
+        {
+            Registry &shared = registry();
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            current = totals(shared);
+            baseline = shared.baseline;
+        }
+
+        const double rate = ticksPerNanosecond();
+        Snapshot result;
+
+        for (size_t i = 0; i < stageCount; i++) {
+            result.nanoseconds[i] = (uint64_t) ((double) (current.ticks[i] - baseline.ticks[i]) / rate);
+            result.calls[i] = current.calls[i] - baseline.calls[i];
+        }
+
+        for (size_t i = 0; i < counterCount; i++) {
+            result.counters[i] = current.counters[i] - baseline.counters[i];
+        }
+
+        return result;
+    }
+
+    void reset() {
+        Registry &shared = registry();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.baseline = totals(shared);
+    }
+#else
+    Snapshot snapshot() {
+        return Snapshot{};
+    }
+
+    void reset() {}
+#endif
+
+    std::string formatText(const Snapshot &snapshot) {
+        if (!enabled()) {
+            return "Statistics are not compiled in, build with make STATS=1.\n";
+        }
+
+        char line[128];
+        std::string text;
+
+        snprintf(line, sizeof(line), "%-16s %14s %14s\n", "stage", "ms", "calls");
+        text += line;
+
+        for (size_t i = 0; i < stageCount; i++) {
+            snprintf(line, sizeof(line), "%-16s %14.3f %14" PRIu64 "\n", stageNames[i], (double) snapshot.nanoseconds[i] / 1e6,
+                     snapshot.calls[i]);
+            text += line;
+        }
+
+        snprintf(line, sizeof(line), "%-16s %14s\n", "counter", "value");
+        text += line;
+
+        for (size_t i = 0; i < counterCount; i++) {
+            snprintf(line, sizeof(line), "%-16s %14" PRIu64 "\n", counterNames[i], snapshot.counters[i]);
+            text += line;
+        }
+
+        return text;
+    }
+
+    std::string formatJson(const Snapshot &snapshot) {
+        char field[128];
+        std::string json = enabled() ? "{\"enabled\":true,\"stages\":{" : "{\"enabled\":false,\"stages\":{";
+
+        for (size_t i = 0; i < stageCount; i++) {
+            snprintf(field, sizeof(field), "%s\"%s\":{\"ns\":%" PRIu64 ",\"calls\":%" PRIu64 "}", i > 0 ? "," : "", stageNames[i],
+                     snapshot.nanoseconds[i], snapshot.calls[i]);
+            json += field;
+        }
+
+        json += "},\"counters\":{";
+
+        for (size_t i = 0; i < counterCount; i++) {
+            snprintf(field, sizeof(field), "%s\"%s\":%" PRIu64, i > 0 ? "," : "", counterNames[i], snapshot.counters[i]);
+            json += field;
+        }
+
+        return json + "}}\n";
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef PARSER_STATS_H
+#define PARSER_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Per-stage timers and throughput counters for the parser and the encoder. They are only compiled in when
+// PARSER_STATS is defined, as the Makefile does unless given STATS=0; otherwise STATS_TIMER and STATS_COUNT expand to
+// nothing and snapshot() returns zeros.
+namespace stats {
+    enum class Stage : uint8_t {
+        READ_FILE,      // Opening and mapping or reading input files. Mapped pages are read on first touch, which
+                        // is accounted to the stage that touches them first, e.g. PIXEL_HASH or COLOR_CONVERT.
+        PIXEL_COPY,     // Copying pixels out of the input buffer in parseCiff() and friends.
+        PIXEL_HASH,     // Hashing frame pixels to find repeated frames.
+        COLOR_CONVERT,  // RGB to YCbCr conversion of scanlines in the encoder.
+        DCT,            // Forward DCT and quantization of 8x8 blocks, including loading them from the MCU lines.
+        ENTROPY_CODE,   // Huffman statistics and coding of quantized blocks. Both encoder stages are timed once per MCU
+                        // row, since timing every block costs several percent of the encode.
+        WRITE_OUTPUT,   // Writing JPEG and AVI files. Where the encoder writes a file as it goes, this time is
+                        // also part of ENTROPY_CODE.
+        COUNT
+    };
+
+    enum class Counter : uint8_t {
+        BYTES_PARSED,   // Bytes of CIFF images (headers and pixels) parsed, on their own or as animation frames.
+                        // Loading an already indexed frame does not count again.
+        FRAMES,         // CAFF animation blocks parsed.
+        MCUS,           // Minimum coded units encoded.
+        OUTPUT_BYTES,   // Bytes of JPEG data produced by the encoder.
+        COUNT
+    };
+
+    static const size_t stageCount = (size_t) Stage::COUNT;
+    static const size_t counterCount = (size_t) Counter::COUNT;
+
+    // Totals since the start of the process or the last reset(), over all threads.
+    struct Snapshot {
+        uint64_t nanoseconds[stageCount];
+        uint64_t calls[stageCount];
+        uint64_t counters[counterCount];
+    };
+
+    constexpr bool enabled() {
+#ifdef PARSER_STATS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // snake_case names, as used in both output formats.
+    const char *stageName(Stage stage);
+
+    const char *counterName(Counter counter);
+
+    Snapshot snapshot();
+
+    void reset();
+
+    std::string formatText(const Snapshot &snapshot);
+
+    std::string formatJson(const Snapshot &snapshot);
+
+#ifdef PARSER_STATS
+    // Every thread adds to its own slots, which only it writes, so recording costs a plain load and store; snapshot()
+    // sums the slots of all live threads and those left behind by finished ones.
+    struct ThreadStats {
+        ThreadStats();
+        ~ThreadStats();
+
+        std::atomic<uint64_t> ticks[stageCount];
+        std::atomic<uint64_t> calls[stageCount];
+        std::atomic<uint64_t> counters[counterCount];
+    };
+
+    ThreadStats &threadStats();
+
+    // A timestamp in clock ticks: the time stamp counter where there is one, nanoseconds otherwise.
+    uint64_t ticks();
+
+    inline void add(std::atomic<uint64_t> &slot, uint64_t value) {
+        slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    inline void count(Counter counter, uint64_t value) {
+        add(threadStats().counters[(size_t) counter], value);
+    }
+
+    // Adds the time from construction to destruction to stage.
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Stage stage) : slots(threadStats()), stage((size_t) stage), start(ticks()) {}
+
+        ~ScopedTimer() {
+            add(slots.ticks[stage], ticks() - start);
+            add(slots.calls[stage], 1);
+        }
+
+        ScopedTimer(const ScopedTimer &) = delete;
+        ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+    private:
+        ThreadStats &slots;
+        const size_t stage;
+        const uint64_t start;
+    };
+#endif
+}
+
+#ifdef PARSER_STATS
+#define STATS_JOIN2(a, b) a##b
+#define STATS_JOIN(a, b) STATS_JOIN2(a, b)
+#define STATS_TIMER(stage) stats::ScopedTimer STATS_JOIN(statsTimer, __LINE__)(stats::Stage::stage)
+#define STATS_COUNT(counter, value) stats::count(stats::Counter::counter, (value))
+#else
+#define STATS_TIMER(stage) ((void) 0)
+#define STATS_COUNT(counter, value) ((void) 0)
+#endif
+
+#endif //PARSER_STATS_H